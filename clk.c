@@ -0,0 +1,127 @@
+/*
+ * clk.c
+ *
+ * Copyright (c) 2014 Jeremy Garff <jer @ jers.net>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdint.h>
+
+#include "clk.h"
+
+
+/**
+ * Work out the divider setting for one clock source and check how close it gets.
+ *
+ * @param    src_freq  Source frequency in Hz.
+ * @param    src       CM_CLK_CTL_SRC_* value of the source.
+ * @param    target    Wanted clock frequency in Hz.
+ * @param    frac      Use the fractional divider with MASH 1.
+ * @param    plan      Filled in with the divider setting and achieved frequency.
+ *
+ * @returns  0 if the source can produce the clock, -1 otherwise.
+ */
+static int clk_plan_source(uint32_t src_freq, uint32_t src, uint32_t target, int frac, clk_plan_t *plan)
+{
+    // Divisor in 1/4096ths, as programmed into DIVI and DIVF
+    uint64_t div = (((uint64_t)src_freq << 12) + (target / 2)) / target;
+
+    if (!frac)
+    {
+        div = (div + 0x800) & ~0xfffULL;
+    }
+
+    // MASH 1 needs a divisor of at least 2, too small also means too much jitter
+    if ((div >> 12) < (frac ? CLK_MASH_DIV_MIN : 1) || (div >> 12) > 0xfff)
+    {
+        return -1;
+    }
+
+    plan->src = src;
+    plan->divi = div >> 12;
+    plan->divf = div & 0xfff;
+    plan->mash = plan->divf ? 1 : 0;
+    plan->freq = ((uint64_t)src_freq << 12) / div;
+
+    return 0;
+}
+
+/**
+ * Choose the clock source and divider that get closest to the wanted
+ * frequency.  The oscillator with an integer divider is preferred, then
+ * PLLD, and the fractional divider is only used when the source is fast
+ * enough for the MASH jitter to stay a small part of the output period.
+ *
+ * @param    osc_freq   Oscillator frequency in Hz.
+ * @param    plld_freq  PLLD frequency in Hz.
+ * @param    target     Wanted clock frequency in Hz.
+ * @param    plan       Filled in with the chosen setting.
+ *
+ * @returns  0 on success, -1 if no source can produce the frequency.
+ */
+int clk_plan(uint32_t osc_freq, uint32_t plld_freq, uint32_t target, clk_plan_t *plan)
+{
+    const struct
+    {
+        uint32_t freq;
+        uint32_t src;
+        int frac;
+    } candidates[] =
+    {
+        { osc_freq, CM_CLK_CTL_SRC_OSC, 0 },
+        { plld_freq, CM_CLK_CTL_SRC_PLLD, 0 },
+        { osc_freq, CM_CLK_CTL_SRC_OSC, 1 },
+        { plld_freq, CM_CLK_CTL_SRC_PLLD, 1 },
+    };
+    uint32_t best_err = ~0;
+    unsigned i;
+
+    if (!target)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++)
+    {
+        clk_plan_t try;
+        uint32_t err;
+
+        if (clk_plan_source(candidates[i].freq, candidates[i].src, target, candidates[i].frac, &try))
+        {
+            continue;
+        }
+
+        err = try.freq > target ? try.freq - target : target - try.freq;
+        if (err < best_err)
+        {
+            *plan = try;
+            best_err = err;
+        }
+    }
+
+    return best_err == (uint32_t)~0 ? -1 : 0;
+}
+
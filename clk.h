@@ -63,4 +63,24 @@ typedef struct {
 #define CM_PWM_OFFSET                            (0x001010a0)
 
 
+#define PLLD_FREQ                                500000000  // PLLD_PER frequency
+#define PLLD_FREQ_PI4                            750000000  // Pi 4 PLLD_PER frequency
+
+// MASH 1 moves each edge by up to one source period, only use it when that
+// is at most 1/64th of the output period
+#define CLK_MASH_DIV_MIN                         64
+
+
+typedef struct {
+    uint32_t src;                                // CM_CLK_CTL_SRC_* clock source
+    uint32_t divi;                               // Integer part of the divisor
+    uint32_t divf;                               // Fractional part of the divisor in 1/4096ths
+    uint32_t mash;                               // MASH noise shaping stages, 0 for integer division
+    uint32_t freq;                               // Achieved (average) frequency in Hz
+} clk_plan_t;
+
+
+int clk_plan(uint32_t osc_freq, uint32_t plld_freq, uint32_t target, clk_plan_t *plan);
+
+
 #endif /* __CLK_H__ */
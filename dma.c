@@ -75,4 +75,36 @@ uint32_t dmanum_to_offset(int dmanum)
     return dma_offset[dmanum];
 }
 
+uint32_t dma_txfr_len_max(volatile dma_t *dma)
+{
+    if (dma->debug & RPI_DMA_DEBUG_LITE)
+    {
+        return RPI_DMA_LITE_TXFR_LEN_MAX;
+    }
+
+    return RPI_DMA_TXFR_LEN_MAX;
+}
+
+uint32_t dma_channel_mask(int dma4)
+{
+    uint32_t mask_default = dma4 ? 0 : DMA_CHANNEL_MASK_DEFAULT;
+    uint8_t mask[4];
+    FILE *fp;
+
+    fp = fopen(dma4 ? DMA4_CHANNEL_MASK_PATH : DMA_CHANNEL_MASK_PATH, "rb");
+    if (!fp)
+    {
+        return mask_default;
+    }
+
+    // Device tree cells are big endian
+    if (fread(mask, sizeof(mask), 1, fp) != 1)
+    {
+        fclose(fp);
+        return mask_default;
+    }
+    fclose(fp);
+
+    return (mask[0] << 24) | (mask[1] << 16) | (mask[2] << 8) | mask[3];
+}
 
@@ -91,14 +91,101 @@ typedef struct
     uint32_t txfr_len;
 #define RPI_DMA_TXFR_LEN_YLENGTH(val)            ((val & 0xffff) << 16)
 #define RPI_DMA_TXFR_LEN_XLENGTH(val)            ((val & 0xffff) << 0)
+#define RPI_DMA_TXFR_LEN_YLENGTH_MAX             0x3fff  // 14 bit row count in 2D mode
+#define RPI_DMA_TXFR_LEN_MAX                     0x3ffffff8  // 30 bit length on full channels, 64-bit multiple
+#define RPI_DMA_LITE_TXFR_LEN_MAX                0xfff8  // 16 bit length on lite channels, 64-bit multiple
     uint32_t stride;
 #define RPI_DMA_STRIDE_D_STRIDE(val)             ((val & 0xffff) << 16)
 #define RPI_DMA_STRIDE_S_STRIDE(val)             ((val & 0xffff) << 0)
     uint32_t nextconbk;
     uint32_t debug;
+#define RPI_DMA_DEBUG_LITE                       (1 << 28)
+#define RPI_DMA_DEBUG_READ_ERROR                 (1 << 2)
+#define RPI_DMA_DEBUG_FIFO_ERROR                 (1 << 1)
+#define RPI_DMA_DEBUG_READ_LAST_NOT_SET_ERROR    (1 << 0)
 } __attribute__((packed, aligned(4))) dma_t;
 
 
+/*
+ * BCM2711 DMA4 Control Block in Main Memory
+ *
+ * Note: Must start at a 32 byte aligned address.  Addresses are 40 bit ARM
+ *       physical addresses, the upper 8 bits live in srci/desti.  next_cb
+ *       holds the address of the next control block shifted right by 5.
+ */
+typedef struct
+{
+    uint32_t ti;
+    uint32_t src;
+    uint32_t srci;
+    uint32_t dest;
+    uint32_t desti;
+    uint32_t len;
+    uint32_t next_cb;
+    uint32_t resvd_0x1c;
+} __attribute__((packed, aligned(4))) dma4_cb_t;
+
+/*
+ * BCM2711 DMA4 register set
+ */
+typedef struct
+{
+    uint32_t cs;
+#define RPI_DMA4_CS_HALT                         (1 << 31)
+#define RPI_DMA4_CS_ABORT                        (1 << 30)
+#define RPI_DMA4_CS_DISDEBUG                     (1 << 29)
+#define RPI_DMA4_CS_WAIT_FOR_WRITES              (1 << 28)
+#define RPI_DMA4_CS_PANIC_QOS(val)               ((val & 0xf) << 20)
+#define RPI_DMA4_CS_QOS(val)                     ((val & 0xf) << 16)
+#define RPI_DMA4_CS_ERROR                        (1 << 10)
+#define RPI_DMA4_CS_WAITING_FOR_WRITES           (1 << 7)
+#define RPI_DMA4_CS_DREQ_PAUSED                  (1 << 6)
+#define RPI_DMA4_CS_WR_PAUSED                    (1 << 5)
+#define RPI_DMA4_CS_RD_PAUSED                    (1 << 4)
+#define RPI_DMA4_CS_DREQ                         (1 << 3)
+#define RPI_DMA4_CS_INT                          (1 << 2)
+#define RPI_DMA4_CS_END                          (1 << 1)
+#define RPI_DMA4_CS_ACTIVE                       (1 << 0)
+    uint32_t cb;
+    uint32_t resvd_0x08;
+    uint32_t debug;
+#define RPI_DMA4_DEBUG_RESET                     (1 << 23)
+#define RPI_DMA4_DEBUG_READ_ERROR                (1 << 2)
+#define RPI_DMA4_DEBUG_FIFO_ERROR                (1 << 1)
+#define RPI_DMA4_DEBUG_WRITE_ERROR               (1 << 0)
+    uint32_t ti;
+#define RPI_DMA4_TI_D_WAITS(val)                 ((val & 0xff) << 24)
+#define RPI_DMA4_TI_S_WAITS(val)                 ((val & 0xff) << 16)
+#define RPI_DMA4_TI_D_DREQ                       (1 << 15)
+#define RPI_DMA4_TI_S_DREQ                       (1 << 14)
+#define RPI_DMA4_TI_PERMAP(val)                  ((val & 0x1f) << 9)
+#define RPI_DMA4_TI_WAIT_RD_RESP                 (1 << 3)
+#define RPI_DMA4_TI_WAIT_RESP                    (1 << 2)
+#define RPI_DMA4_TI_TDMODE                       (1 << 1)
+#define RPI_DMA4_TI_INTEN                        (1 << 0)
+    uint32_t src;
+    uint32_t srci;
+#define RPI_DMA4_XI_STRIDE(val)                  ((val & 0xffff) << 16)
+#define RPI_DMA4_XI_IGNORE                       (1 << 15)
+#define RPI_DMA4_XI_SIZE_32                      (0 << 13)
+#define RPI_DMA4_XI_SIZE_64                      (1 << 13)
+#define RPI_DMA4_XI_SIZE_128                     (2 << 13)
+#define RPI_DMA4_XI_INC                          (1 << 12)
+#define RPI_DMA4_XI_BURST_LENGTH(val)            ((val & 0xf) << 8)
+#define RPI_DMA4_XI_ADDR_HIGH(val)               ((val & 0xff) << 0)
+    uint32_t dest;
+    uint32_t desti;
+    uint32_t len;
+#define RPI_DMA4_LEN_MAX                         0x3ffffff8  // 30 bit length, 64-bit multiple
+    uint32_t next_cb;
+    uint32_t debug2;
+} __attribute__((packed, aligned(4))) dma4_t;
+
+#define RPI_DMA4_FIRST                           11  // Channels 11-14 are DMA4 engines on BCM2711
+#define RPI_DMA4_LAST                            14
+#define RPI_DMA4_PERIPH_HIGH                     0x4  // Peripherals sit at 0x4_7exx_xxxx for DMA4
+
+
 #define DMA0_OFFSET                              (0x00007000)
 #define DMA1_OFFSET                              (0x00007100)
 #define DMA2_OFFSET                              (0x00007200)
@@ -116,6 +203,13 @@ typedef struct
 #define DMA14_OFFSET                             (0x00007e00)
 #define DMA15_OFFSET                             (0x00e05000)
 
+#define RPI_DMA_CHANNELS                         15  // Channel 15 is reserved for the firmware
+
+// Channels the firmware leaves to Linux, as published in the device tree
+#define DMA_CHANNEL_MASK_PATH                    "/proc/device-tree/soc/dma@7e007000/brcm,dma-channel-mask"
+#define DMA_CHANNEL_MASK_DEFAULT                 0x7f35
+#define DMA4_CHANNEL_MASK_PATH                   "/proc/device-tree/scb/dma@7e007b00/brcm,dma-channel-mask"
+
 
 #define PAGE_SIZE                                (1 << 12)
 #define PAGE_MASK                                (~(PAGE_SIZE - 1))
@@ -123,5 +217,7 @@ typedef struct
 
 
 uint32_t dmanum_to_offset(int dmanum);
+uint32_t dma_txfr_len_max(volatile dma_t *dma);
+uint32_t dma_channel_mask(int dma4);
 
 #endif /* __DMA_H__ */
@@ -247,7 +247,7 @@ void parseargs(int argc, char **argv, ws2811_t *ws2811)
 				"-s (--strip)   - strip type - rgb, grb, gbr, rgbw\n"
 				"-x (--width)   - matrix width (default 8)\n"
 				"-y (--height)  - matrix height (default 8)\n"
-				"-d (--dma)     - dma channel to use (default 10)\n"
+				"-d (--dma)     - dma channel to use, 0 to 14, -1 to pick a free one (default 10)\n"
 				"-g (--gpio)    - GPIO to use\n"
 				"                 If omitted, default is 18 (PWM0)\n"
 				"-i (--invert)  - invert pin output (pulse LOW)\n"
@@ -291,7 +291,7 @@ void parseargs(int argc, char **argv, ws2811_t *ws2811)
 		case 'd':
 			if (optarg) {
 				int dma = atoi(optarg);
-				if (dma < 14) {
+				if (dma >= -1 && dma <= 14) {
 					ws2811->dmanum = dma;
 				} else {
 					printf ("invalid dma %d\n", dma);
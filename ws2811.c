@@ -28,20 +28,32 @@
  */
 
 
+#define _GNU_SOURCE
+
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <arpa/inet.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/timerfd.h>
 #include <signal.h>
 #include <linux/types.h>
 #include <linux/spi/spidev.h>
 #include <time.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
 #include "mailbox.h"
 #include "clk.h"
 #include "gpio.h"
@@ -58,25 +70,40 @@
 #define OSC_FREQ                                 19200000   // crystal frequency
 #define OSC_FREQ_PI4                             54000000   // Pi 4 crystal frequency
 
-/* 4 colors (R, G, B + W), 8 bits per byte, 3 symbols per bit + 55uS low for reset signal */
+/* 4 colors (R, G, B + W), 8 bits per byte, 3-5 symbols per bit + the profile's reset time low */
 #define LED_COLOURS                              4
-#define LED_RESET_uS                             55
-#define LED_BIT_COUNT(leds, freq)                ((leds * LED_COLOURS * 8 * 3) + ((LED_RESET_uS * \
-                                                  (freq * 3)) / 1000000))
+#define LED_BIT_COUNT(leds, freq, symbols, reset_us) \
+                                                 ((leds * LED_COLOURS * 8 * symbols) + ((reset_us * \
+                                                  (freq * symbols)) / 1000000))
 
 /* Minimum time to wait for reset to occur in microseconds. */
 #define LED_RESET_WAIT_TIME                      300
 
-// Pad out to the nearest uint32 + 32-bits for idle low/high times the number of channels
-#define PWM_BYTE_COUNT(leds, freq)               (((((LED_BIT_COUNT(leds, freq) >> 3) & ~0x7) + 4) + 4) * \
-                                                  RPI_PWM_CHANNELS)
-#define PCM_BYTE_COUNT(leds, freq)               ((((LED_BIT_COUNT(leds, freq) >> 3) & ~0x7) + 4) + 4)
+/* Wake up this long before the DMA is expected to finish, then poll the remainder. */
+#define DMA_WAIT_MARGIN_uS                       100
+
+/* Advisory lock file held for the DMA channel in use, one per channel. */
+#define DMA_LOCK_PATH                            "/var/lock/ws2811_dma%d.lock"
+
+/* Number of segment buffers the DMA cycles through when streaming. */
+#define STREAM_SEGMENTS                          4
+
+/* Triple buffer state flag, the middle frame was published and not yet sent. */
+#define FRAME_FRESH                              (1 << 2)
+
+/* Encoder thread shares start on a word that is an LED boundary for both
+ * 3 and 4 color LEDs, 3 * symbols words hold 4 RGB or 3 RGBW LEDs. */
+#define ENCODE_SPLIT_WORDS(symbols)              (3 * (symbols))
+
+// Pad out to the nearest uint32 + 32-bits for idle low/high times, per channel in the FIFO
+#define PCM_BYTE_COUNT(leds, freq, symbols, reset_us) \
+                                                 ((((LED_BIT_COUNT(leds, freq, symbols, reset_us) >> 3) & ~0x7) + 4) + 4)
 
 // Driver mode definitions
 #define NONE	0
-#define PWM	1
-#define PCM	2
-#define SPI	3
+#define PWM	WS2811_MODE_PWM
+#define PCM	WS2811_MODE_PCM
+#define SPI	WS2811_MODE_SPI
 
 // We use the mailbox interface to request memory from the VideoCore.
 // This lets us request one physically contiguous chunk, find its
@@ -91,6 +118,28 @@ typedef struct videocore_mbox {
     uint8_t *virt_addr;     /* From mapmem() */
 } videocore_mbox_t;
 
+// Chip timing, each bit is sent as a number of serializer symbols of which
+// the first t0h (for a 0) or t1h (for a 1) are high
+typedef struct
+{
+    int symbols;                 /* Symbols per bit, 3 to 5 */
+    int t0h;                     /* High symbols for a 0 bit */
+    int t1h;                     /* High symbols for a 1 bit */
+    uint32_t freq;               /* Bit rate used when ws2811_t.freq is 0 */
+    uint32_t reset_us;           /* Low time that latches the data */
+} ws2811_timing_t;
+
+// One rendered frame in DMA memory.  In queue mode the frame control block is
+// followed by zero filled gap blocks which pace the interval to the next frame.
+typedef struct
+{
+    volatile dma_cb_t *dma_cb;   /* First control block, sends the frame data */
+    uint32_t dma_cb_addr;        /* Bus address of dma_cb */
+    volatile dma_cb_t *last_cb;  /* Last control block, nextconbk links the next frame */
+    volatile dma_cb_t *reset_cb; /* Refresh loop: end of the reset, also links the next frame */
+    volatile uint8_t *pxl_raw;   /* Rendered frame data */
+} ws2811_frame_t;
+
 typedef struct ws2811_device
 {
     int driver_mode;
@@ -105,8 +154,107 @@ typedef struct ws2811_device
     volatile cm_clk_t *cm_clk;
     videocore_mbox_t mbox;
     int max_count;
+    clk_plan_t clk;              /* Serializer clock source and divider */
+    uint32_t clk_freq;           /* Serializer clock in Hz as programmed */
+    uint32_t dma_bytes;          /* Bytes moved by the DMA for one frame */
+    struct timespec dma_due;     /* CLOCK_MONOTONIC time the current DMA should be done */
+    uint64_t render_timestamp;   /* Time the last frame was started */
+    struct timespec render_due;  /* CLOCK_MONOTONIC time the last frame has been sent and latched */
+    uint64_t start_ns;           /* CLOCK_MONOTONIC time in ns the last frame was started */
+    uint32_t freq_default;       /* Profile rate put into a 0 .freq, replaced again while unchanged */
+    int timer_fd;                /* Readable once the last frame has latched */
+    uint32_t dma_dest;           /* Bus address of the peripheral FIFO */
+    uint32_t dma_permap;         /* DREQ peripheral number of the FIFO */
+    ws2811_frame_t *frames;      /* Frame buffers, just one unless queueing */
+    int frame_count;
+    int frame_cbs;               /* Control blocks per frame, frame data + gap */
+    uint32_t gap_bytes;          /* Zero bytes sent between queued frames */
+    uint32_t reset_bytes;        /* Refresh loop: leading gap bytes after which a new frame may follow */
+    uint32_t zero_addr;          /* Bus address of the zero word the gap is sent from */
+    int queue_head;              /* Oldest frame still queued for the DMA */
+    int queue_len;               /* Number of frames queued, including the playing one */
+    int frame_loop;              /* The last queued frame loops back onto itself */
+    uint32_t txfr_max;           /* Most bytes one control block can move on this channel */
+    int data_cbs;                /* Control blocks per frame sending the frame data */
+    int dma_lock_fd;             /* Holds the advisory lock on the DMA channel */
+    int dma4;                    /* The channel is a BCM2711 DMA4 engine */
+    int dma_ready;               /* The channel was reset by us and has only stopped cleanly since */
+    int fifo_chans;              /* Channels interleaved in the FIFO, 2 only for dual channel PWM */
+    int chan_first;              /* First channel fed from the FIFO */
+    const ws2811_timing_t *timing;
+    uint32_t symbol_lut[16];     /* Symbols for each nibble, MSB first, 4 * symbols bits */
+    uint32_t frame_size;         /* Bytes in each frame buffer, one segment when streaming */
+    int stream_words;            /* Words per channel in a stream segment, 0 if not streaming */
+    int head_words;              /* Interleaved words per PWM channel before the tail */
+    int tail_words;              /* Words the longer PWM channel sends alone, 0 if padded instead */
+    int tail_chan;               /* PWM channel carried by the tail */
+    int head_cbs;                /* Data control blocks sending the interleaved head */
+    uint8_t *stage;              /* Cached buffer frames are encoded in before the copy to DMA memory */
+    struct ws2811_worker *workers;
+    int worker_count;            /* Encoder threads besides the calling thread */
+    pthread_mutex_t work_lock;
+    pthread_cond_t work_cond;    /* Signals a new frame, or work_stop, to the encoder threads */
+    pthread_cond_t done_cond;    /* Signals the last encoder thread finished its share */
+    unsigned int work_gen;       /* Bumped for every frame handed out */
+    int work_done;               /* Encoder threads done with the current frame */
+    int work_stop;
+    volatile uint32_t *work_raw; /* Buffer the current frame is encoded into */
+    ws2811_led_t *frame_leds[RPI_PWM_CHANNELS];   /* Three published frame buffers per channel */
+    const ws2811_led_t *render_leds[RPI_PWM_CHANNELS];  /* Frame the render thread is sending */
+    const ws2811_led_t *encode_leds[RPI_PWM_CHANNELS];  /* LED arrays of the frame being encoded */
+    int leds_owned[RPI_PWM_CHANNELS];  /* channel[].leds was allocated by us and is freed by us */
+    int leds_count[RPI_PWM_CHANNELS];  /* LEDs channel[].leds was last sized for by us */
+    int frame_cur;               /* Frame last started in plain mode, the other one is encoded next */
+    int frame_prepared;          /* The idle frame holds a frame from ws2811_prepare() */
+    int frame_pair;              /* Plain mode keeps a second frame, from the first ws2811_prepare() on */
+    atomic_uint frame_state;     /* Middle buffer index, FRAME_FRESH when not yet taken */
+    int frame_back;              /* Buffer the application fills */
+    int frame_front;             /* Buffer the render thread sends */
+    pthread_t render_tid;
+    int render_running;
+    atomic_int render_stop;
+    atomic_int render_ret;       /* Last error from the render thread */
 } ws2811_device_t;
 
+// Encoder thread state
+typedef struct ws2811_worker
+{
+    pthread_t thread;
+    ws2811_t *ws2811;
+    int index;
+} ws2811_worker_t;
+
+// Resumable encoder for one channel, turns LEDs into serializer words on demand
+typedef struct
+{
+    const ws2811_channel_t *channel;
+    const ws2811_led_t *leds;    /* LED array to encode, the channel's or a published frame */
+    int led;                     /* Next LED to encode */
+    int scale;                   /* Brightness scale */
+    int nibbles;                 /* Nibbles per LED, 2 per color */
+    int nibble;                  /* Next nibble of rgbw to encode */
+    uint8_t rgbw[4];             /* Gamma corrected colors of the current LED */
+    const uint32_t *lut;         /* Symbols for each nibble */
+    int lut_bits;                /* Bits per lut entry */
+    uint32_t invert;             /* Mask to invert the symbols with */
+    int swap;                    /* Store words in big endian order */
+    uint64_t bits;               /* Encoded symbols not yet written, MSB first */
+    int nbits;                   /* Number of valid bits in bits */
+} ws2811_encoder_t;
+
+// Chip timing profiles indexed by WS2811_TIMING_xxx, times are at the profile's bit rate
+static const ws2811_timing_t timing_profiles[] =
+{
+    [WS2811_TIMING_DEFAULT] =     { 3, 1, 2,  800000,  55 },    // T0H 417ns, T1H 833ns
+    [WS2811_TIMING_WS2812B] =     { 3, 1, 2,  800000, 280 },    // T0H 417ns, T1H 833ns
+    [WS2811_TIMING_WS2813] =      { 3, 1, 2,  800000, 280 },    // T0H 417ns, T1H 833ns
+    [WS2811_TIMING_WS2815] =      { 3, 1, 2,  800000, 280 },    // T0H 417ns, T1H 833ns
+    [WS2811_TIMING_SK6812] =      { 4, 1, 2,  800000,  80 },    // T0H 313ns, T1H 625ns
+    [WS2811_TIMING_GS8208] =      { 4, 1, 2,  800000, 280 },    // T0H 313ns, T1H 625ns
+    [WS2811_TIMING_WS2812B_1M] =  { 3, 1, 2, 1000000, 280 },    // T0H 333ns, T1H 667ns
+    [WS2811_TIMING_SK6812_1M2] =  { 5, 2, 3, 1200000,  80 },    // T0H 333ns, T1H 500ns
+};
+
 /**
  * Provides monotonic timestamp in microseconds.
  *
@@ -123,6 +271,100 @@ static uint64_t get_microsecond_timestamp()
     return (uint64_t) t.tv_sec * 1000000 + t.tv_nsec / 1000;
 }
 
+/**
+ * Provides CLOCK_MONOTONIC timestamp in nanoseconds, the clock deadlines
+ * passed to ws2811_render_at() are given in.
+ *
+ * @returns  Current timestamp in nanoseconds or 0 on error.
+ */
+static uint64_t get_nanosecond_timestamp()
+{
+    struct timespec t;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &t) != 0) {
+        return 0;
+    }
+
+    return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/**
+ * Advance a timespec by a number of microseconds.
+ *
+ * @param    ts  timespec to advance.
+ * @param    us  Microseconds to add.
+ *
+ * @returns  None
+ */
+static void timespec_add_us(struct timespec *ts, uint64_t us)
+{
+    ts->tv_sec += us / 1000000;
+    ts->tv_nsec += (us % 1000000) * 1000;
+    if (ts->tv_nsec >= 1000000000)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+/**
+ * Get the frequency of the oscillator used to clock the PWM and PCM serializer.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  Oscillator frequency in Hz.
+ */
+static uint32_t clk_osc_freq(ws2811_t *ws2811)
+{
+    if (ws2811->rpi_hw->type == RPI_HWVER_TYPE_PI4)
+    {
+        return OSC_FREQ_PI4;
+    }
+
+    return OSC_FREQ;
+}
+
+/**
+ * Get the PLLD frequency of the board.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  PLLD frequency in Hz.
+ */
+static uint32_t clk_plld_freq(ws2811_t *ws2811)
+{
+    if (ws2811->rpi_hw->type == RPI_HWVER_TYPE_PI4)
+    {
+        return PLLD_FREQ_PI4;
+    }
+
+    return PLLD_FREQ;
+}
+
+/**
+ * Program the serializer clock as planned by ws2811_init().  The clock must
+ * already be stopped.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void clk_setup(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    volatile cm_clk_t *cm_clk = device->cm_clk;
+    uint32_t ctl = CM_CLK_CTL_PASSWD | CM_CLK_CTL_MASH(device->clk.mash) | device->clk.src;
+
+    cm_clk->div = CM_CLK_DIV_PASSWD | CM_CLK_DIV_DIVI(device->clk.divi) | CM_CLK_DIV_DIVF(device->clk.divf);
+    cm_clk->ctl = ctl;
+    cm_clk->ctl = ctl | CM_CLK_CTL_ENAB;
+    usleep(10);
+    while (!(cm_clk->ctl & CM_CLK_CTL_BUSY))
+        ;
+
+    device->clk_freq = device->clk.freq;
+}
+
 /**
  * Iterate through the channels and find the largest led count.
  *
@@ -145,6 +387,90 @@ static int max_channel_led_count(ws2811_t *ws2811)
     return max;
 }
 
+/**
+ * Check whether a DMA channel is one of the BCM2711 DMA4 engines.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    dmanum  DMA channel number.
+ *
+ * @returns  1 for DMA4, 0 for a legacy (full or lite) engine.
+ */
+static int dma_is_dma4(ws2811_t *ws2811, int dmanum)
+{
+    return (ws2811->rpi_hw->type == RPI_HWVER_TYPE_PI4) &&
+           (dmanum >= RPI_DMA4_FIRST) && (dmanum <= RPI_DMA4_LAST);
+}
+
+/**
+ * Find out how many bytes one control block can move on a DMA channel.
+ * Lite channels are limited to 16 bit lengths.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    dmanum  DMA channel to probe.
+ *
+ * @returns  Maximum txfr_len, the lite limit if the channel can't be probed.
+ */
+static uint32_t dma_probe_txfr_max(ws2811_t *ws2811, int dmanum)
+{
+    uint32_t dma_addr = dmanum_to_offset(dmanum);
+    volatile dma_t *dma;
+    uint32_t txfr_max;
+
+    if (dma_is_dma4(ws2811, dmanum))
+    {
+        return RPI_DMA4_LEN_MAX;
+    }
+
+    if (!dma_addr)
+    {
+        return RPI_DMA_LITE_TXFR_LEN_MAX;
+    }
+
+    dma = mapmem(dma_addr + ws2811->rpi_hw->periph_base, sizeof(dma_t), DEV_MEM);
+    if (!dma)
+    {
+        return RPI_DMA_LITE_TXFR_LEN_MAX;
+    }
+
+    txfr_max = dma_txfr_len_max(dma);
+    unmapmem((void *)dma, sizeof(dma_t));
+
+    return txfr_max;
+}
+
+/**
+ * Check whether a DMA channel is running, as a channel the firmware or another
+ * driver uses without telling Linux would be.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    dmanum  DMA channel to check.
+ *
+ * @returns  1 if active or the channel can't be checked, 0 otherwise.
+ */
+static int dma_probe_active(ws2811_t *ws2811, int dmanum)
+{
+    uint32_t dma_addr = dmanum_to_offset(dmanum);
+    volatile dma_t *dma;
+    int active;
+
+    if (!dma_addr)
+    {
+        return 1;
+    }
+
+    // ACTIVE is in the same place in the DMA4 CS register
+    dma = mapmem(dma_addr + ws2811->rpi_hw->periph_base, sizeof(dma_t), DEV_MEM);
+    if (!dma)
+    {
+        return 1;
+    }
+
+    active = (dma->cs & RPI_DMA_CS_ACTIVE) ? 1 : 0;
+    unmapmem((void *)dma, sizeof(dma_t));
+
+    return active;
+}
+
 /**
  * Map all devices into userspace memory.
  * Not called for SPI
@@ -323,972 +649,3915 @@ static void stop_pcm(ws2811_t *ws2811)
 }
 
 /**
- * Setup the PWM controller in serial mode on both channels using DMA to feed the PWM FIFO.
+ * Look up the timing profile selected by ws2811->timing.
  *
  * @param    ws2811  ws2811 instance pointer.
  *
- * @returns  None
+ * @returns  Timing profile, NULL if it doesn't exist.
  */
-static int setup_pwm(ws2811_t *ws2811)
+static const ws2811_timing_t *timing_profile(ws2811_t *ws2811)
 {
-    ws2811_device_t *device = ws2811->device;
-    volatile dma_t *dma = device->dma;
-    volatile dma_cb_t *dma_cb = device->dma_cb;
-    volatile pwm_t *pwm = device->pwm;
-    volatile cm_clk_t *cm_clk = device->cm_clk;
-    int maxcount = device->max_count;
-    uint32_t freq = ws2811->freq;
-    int32_t byte_count;
+    if ((ws2811->timing < 0) ||
+        (ws2811->timing >= (int)(sizeof(timing_profiles) / sizeof(timing_profiles[0]))))
+    {
+        return NULL;
+    }
 
-    const rpi_hw_t *rpi_hw = ws2811->rpi_hw;
-    const uint32_t rpi_type = rpi_hw->type;
-    uint32_t osc_freq = OSC_FREQ;
+    return &timing_profiles[ws2811->timing];
+}
+
+/**
+ * Resolve the bit rate for a timing profile.  A .freq of 0, or one still
+ * holding the default an earlier profile filled in, takes the profile's.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    timing  Timing profile.
+ *
+ * @returns  Bit rate in Hz.
+ */
+static uint32_t timing_freq(ws2811_t *ws2811, const ws2811_timing_t *timing)
+{
+    ws2811_device_t *device = ws2811->device;
 
-    if(rpi_type == RPI_HWVER_TYPE_PI4){
-        osc_freq = OSC_FREQ_PI4;
+    if (!ws2811->freq || (device->freq_default && (ws2811->freq == device->freq_default)))
+    {
+        return timing->freq;
     }
 
-    stop_pwm(ws2811);
+    return ws2811->freq;
+}
 
-    // Setup the Clock - Use OSC @ 19.2Mhz w/ 3 clocks/tick
-    cm_clk->div = CM_CLK_DIV_PASSWD | CM_CLK_DIV_DIVI(osc_freq / (3 * freq));
-    cm_clk->ctl = CM_CLK_CTL_PASSWD | CM_CLK_CTL_SRC_OSC;
-    cm_clk->ctl = CM_CLK_CTL_PASSWD | CM_CLK_CTL_SRC_OSC | CM_CLK_CTL_ENAB;
-    usleep(10);
-    while (!(cm_clk->ctl & CM_CLK_CTL_BUSY))
-        ;
+/**
+ * Select the timing profile and build the symbol table for it.  A bit rate of
+ * 0 is replaced with the profile's default, and so is that default when the
+ * profile changes later.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, -1 if the profile doesn't exist.
+ */
+static int timing_setup(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    const ws2811_timing_t *timing = timing_profile(ws2811);
+    uint32_t one, zero;
+    int nibble, bit;
 
-    // Setup the PWM, use delays as the block is rumored to lock up without them.  Make
-    // sure to use a high enough priority to avoid any FIFO underruns, especially if
-    // the CPU is busy doing lots of memory accesses, or another DMA controller is
-    // busy.  The FIFO will clock out data at a much slower rate (2.6Mhz max), so
-    // the odds of a DMA priority boost are extremely low.
+    if (!timing)
+    {
+        return -1;
+    }
 
-    pwm->rng1 = 32;  // 32-bits per word to serialize
-    usleep(10);
-    pwm->ctl = RPI_PWM_CTL_CLRF1;
-    usleep(10);
-    pwm->dmac = RPI_PWM_DMAC_ENAB | RPI_PWM_DMAC_PANIC(7) | RPI_PWM_DMAC_DREQ(3);
-    usleep(10);
-    pwm->ctl = RPI_PWM_CTL_USEF1 | RPI_PWM_CTL_MODE1 |
-               RPI_PWM_CTL_USEF2 | RPI_PWM_CTL_MODE2;
-    if (ws2811->channel[0].invert)
+    device->timing = timing;
+
+    if (timing_freq(ws2811, timing) != ws2811->freq)
     {
-        pwm->ctl |= RPI_PWM_CTL_POLA1;
+        ws2811->freq = timing->freq;
+        device->freq_default = timing->freq;
     }
-    if (ws2811->channel[1].invert)
+    else if (ws2811->freq != device->freq_default)
     {
-        pwm->ctl |= RPI_PWM_CTL_POLA2;
+        device->freq_default = 0;
     }
-    usleep(10);
-    pwm->ctl |= RPI_PWM_CTL_PWEN1 | RPI_PWM_CTL_PWEN2;
 
-    // Initialize the DMA control block
-    byte_count = PWM_BYTE_COUNT(maxcount, freq);
-    dma_cb->ti = RPI_DMA_TI_NO_WIDE_BURSTS |  // 32-bit transfers
-                 RPI_DMA_TI_WAIT_RESP |       // wait for write complete
-                 RPI_DMA_TI_DEST_DREQ |       // user peripheral flow control
-                 RPI_DMA_TI_PERMAP(5) |       // PWM peripheral
-                 RPI_DMA_TI_SRC_INC;          // Increment src addr
+    // High for the first t0h/t1h symbols of the bit, low for the rest
+    one = ((1 << timing->t1h) - 1) << (timing->symbols - timing->t1h);
+    zero = ((1 << timing->t0h) - 1) << (timing->symbols - timing->t0h);
 
-    dma_cb->source_ad = addr_to_bus(device, device->pxl_raw);
+    for (nibble = 0; nibble < 16; nibble++)
+    {
+        uint32_t symbols = 0;
 
-    dma_cb->dest_ad = (uintptr_t)&((pwm_t *)PWM_PERIPH_PHYS)->fif1;
-    dma_cb->txfr_len = byte_count;
-    dma_cb->stride = 0;
-    dma_cb->nextconbk = 0;
+        for (bit = 3; bit >= 0; bit--)
+        {
+            symbols = (symbols << timing->symbols) | (((nibble >> bit) & 1) ? one : zero);
+        }
 
-    dma->cs = 0;
-    dma->txfr_len = 0;
+        device->symbol_lut[nibble] = symbols;
+    }
 
     return 0;
 }
 
 /**
- * Setup the PCM controller with one 32-bit channel in a 32-bit frame using DMA to feed the PCM FIFO.
+ * Number of DMA bytes one frame needs in the current driver mode.
  *
  * @param    ws2811  ws2811 instance pointer.
  *
- * @returns  None
+ * @returns  Frame size in bytes.
  */
-static int setup_pcm(ws2811_t *ws2811)
+static uint32_t frame_bytes(ws2811_t *ws2811)
 {
     ws2811_device_t *device = ws2811->device;
-    volatile dma_t *dma = device->dma;
-    volatile dma_cb_t *dma_cb = device->dma_cb;
-    volatile pcm_t *pcm = device->pcm;
-    volatile cm_clk_t *cm_clk = device->cm_clk;
-    //int maxcount = max_channel_led_count(ws2811);
-    int maxcount = device->max_count;
-    uint32_t freq = ws2811->freq;
-    int32_t byte_count;
+    const ws2811_timing_t *timing = device->timing;
 
-    const rpi_hw_t *rpi_hw = ws2811->rpi_hw;
-    const uint32_t rpi_type = rpi_hw->type;
-    uint32_t osc_freq = OSC_FREQ;
+    return PCM_BYTE_COUNT(device->max_count, ws2811->freq, timing->symbols, timing->reset_us) *
+           device->fifo_chans;
+}
 
-    if(rpi_type == RPI_HWVER_TYPE_PI4){
-        osc_freq = OSC_FREQ_PI4;
+/**
+ * Work out whether the longer PWM channel can finish on its own once the
+ * shorter one is done, instead of padding the shorter one with zeros.
+ *
+ * Only memory is saved: the FIFO still takes a word for each channel, so the
+ * bus time is unchanged.  The tail is sent with 2D control blocks that read
+ * overlapping pairs of words: the longer channel gets its data in order and
+ * the shorter one the same data a word out of step.  Blanking the shorter
+ * lane instead would need a zero word per tail word, undoing the saving.
+ * With no reset gap in between, those bits just shift out past the end of the
+ * shorter strip, so LEDs beyond its count show them.  Only done when asked
+ * for through pwm_tail, and only full legacy channels have 2D mode.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void pwm_tail_setup(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    int shorter = ws2811->channel[0].count < ws2811->channel[1].count ? 0 : 1;
+    ws2811_channel_t *channel = &ws2811->channel[shorter];
+    int words = frame_bytes(ws2811) / sizeof(uint32_t) / RPI_PWM_CHANNELS;
+    int colors = (channel->strip_type & SK6812_SHIFT_WMASK) ? 4 : 3;
+    int head;
+
+    if (!ws2811->pwm_tail || (device->fifo_chans != RPI_PWM_CHANNELS) || device->dma4 ||
+        (device->txfr_max < RPI_DMA_TXFR_LEN_MAX))
+    {
+        return;
     }
 
-    stop_pcm(ws2811);
+    // Exactly the shorter channel's bits, trailing zeros would latch it early
+    head = (channel->count * colors * 8 * device->timing->symbols + 31) / 32;
 
-    // Setup the PCM Clock - Use OSC @ 19.2Mhz w/ 3 clocks/tick
-    cm_clk->div = CM_CLK_DIV_PASSWD | CM_CLK_DIV_DIVI(osc_freq / (3 * freq));
-    cm_clk->ctl = CM_CLK_CTL_PASSWD | CM_CLK_CTL_SRC_OSC;
-    cm_clk->ctl = CM_CLK_CTL_PASSWD | CM_CLK_CTL_SRC_OSC | CM_CLK_CTL_ENAB;
-    usleep(10);
-    while (!(cm_clk->ctl & CM_CLK_CTL_BUSY))
-        ;
+    // The tail costs a lead and a spare word
+    if (words - head <= 2)
+    {
+        return;
+    }
 
-    // Setup the PCM, use delays as the block is rumored to lock up without them.  Make
-    // sure to use a high enough priority to avoid any FIFO underruns, especially if
-    // the CPU is busy doing lots of memory accesses, or another DMA controller is
-    // busy.  The FIFO will clock out data at a much slower rate (2.6Mhz max), so
-    // the odds of a DMA priority boost are extremely low.
+    device->head_words = head;
+    device->tail_words = words - head;
+    device->tail_chan = !shorter;
+    device->frame_size = (head * RPI_PWM_CHANNELS + device->tail_words + 2) * sizeof(uint32_t);
 
-    pcm->cs = RPI_PCM_CS_EN;            // Enable PCM hardware
-    pcm->mode = (RPI_PCM_MODE_FLEN(31) | RPI_PCM_MODE_FSLEN(1));
-                // Framelength 32, clock enabled, frame sync pulse
-    pcm->txc = RPI_PCM_TXC_CH1WEX | RPI_PCM_TXC_CH1EN | RPI_PCM_TXC_CH1POS(0) | RPI_PCM_TXC_CH1WID(8);
-               // Single 32-bit channel
-    pcm->cs |= RPI_PCM_CS_TXCLR;        // Reset transmit fifo
-    usleep(10);
-    pcm->cs |= RPI_PCM_CS_DMAEN;         // Enable DMA DREQ
-    pcm->dreq = (RPI_PCM_DREQ_TX(0x3F) | RPI_PCM_DREQ_TX_PANIC(0x10)); // Set FIFO tresholds
+    // Keep the following frames aligned for the encoder's 64-bit stores
+    device->frame_size = (device->frame_size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+}
+
+/**
+ * Take the advisory lock on a DMA channel so no other process or instance
+ * uses it at the same time.  The lock is held until ws2811_fini().  If the
+ * lock file can't be created the channel is used unlocked.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    dmanum  DMA channel to reserve.
+ *
+ * @returns  0 on success, -1 if the channel is held by someone else.
+ */
+static int dma_reserve(ws2811_t *ws2811, int dmanum)
+{
+    ws2811_device_t *device = ws2811->device;
+    char path[64];
+    int fd;
 
-    // Initialize the DMA control block
-    byte_count = PCM_BYTE_COUNT(maxcount, freq);
-    dma_cb->ti = RPI_DMA_TI_NO_WIDE_BURSTS |  // 32-bit transfers
-                 RPI_DMA_TI_WAIT_RESP |       // wait for write complete
-                 RPI_DMA_TI_DEST_DREQ |       // user peripheral flow control
-                 RPI_DMA_TI_PERMAP(2) |       // PCM TX peripheral
-                 RPI_DMA_TI_SRC_INC;          // Increment src addr
+    snprintf(path, sizeof(path), DMA_LOCK_PATH, dmanum);
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Can't open %s, DMA channel %d is not reserved\n", path, dmanum);
+        return 0;
+    }
 
-    dma_cb->source_ad = addr_to_bus(device, device->pxl_raw);
-    dma_cb->dest_ad = (uintptr_t)&((pcm_t *)PCM_PERIPH_PHYS)->fifo;
-    dma_cb->txfr_len = byte_count;
-    dma_cb->stride = 0;
-    dma_cb->nextconbk = 0;
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0)
+    {
+        close(fd);
+        return -1;
+    }
 
-    dma->cs = 0;
-    dma->txfr_len = 0;
+    device->dma_lock_fd = fd;
 
     return 0;
 }
 
 /**
- * Start the DMA feeding the PWM FIFO.  This will stream the entire DMA buffer out of both
- * PWM channels.
+ * Pick and reserve a DMA channel.  Only channels the firmware hands to Linux
+ * are considered.  Kernel drivers take those from the lowest number up, so
+ * the search runs from the top, skipping channels that are running.  Lite
+ * channels are as good as full ones, long frames are chained over several
+ * control blocks.
  *
  * @param    ws2811  ws2811 instance pointer.
  *
- * @returns  None
+ * @returns  DMA channel number, -1 if none is free.
  */
-static void dma_start(ws2811_t *ws2811)
+static int dma_select(ws2811_t *ws2811)
 {
-    ws2811_device_t *device = ws2811->device;
-    volatile dma_t *dma = device->dma;
-    volatile pcm_t *pcm = device->pcm;
-    uint32_t dma_cb_addr = device->dma_cb_addr;
-
-    dma->cs = RPI_DMA_CS_RESET;
-    usleep(10);
+    uint32_t mask = dma_channel_mask(0);
+    int dmanum;
 
-    dma->cs = RPI_DMA_CS_INT | RPI_DMA_CS_END;
-    usleep(10);
+    // The DMA4 engines are listed in their own device tree node
+    if (ws2811->rpi_hw->type == RPI_HWVER_TYPE_PI4)
+    {
+        uint32_t dma4_mask = ((1 << (RPI_DMA4_LAST + 1)) - 1) & ~((1 << RPI_DMA4_FIRST) - 1);
 
-    dma->conblk_ad = dma_cb_addr;
-    dma->debug = 7; // clear debug error flags
-    dma->cs = RPI_DMA_CS_WAIT_OUTSTANDING_WRITES |
-              RPI_DMA_CS_PANIC_PRIORITY(15) |
-              RPI_DMA_CS_PRIORITY(15) |
-              RPI_DMA_CS_ACTIVE;
+        mask = (mask & ~dma4_mask) | (dma_channel_mask(1) & dma4_mask);
+    }
 
-    if (device->driver_mode == PCM)
+    for (dmanum = RPI_DMA_CHANNELS - 1; dmanum >= 0; dmanum--)
     {
-        pcm->cs |= RPI_PCM_CS_TXON;  // Start transmission
+        if (!(mask & (1 << dmanum)) || dma_probe_active(ws2811, dmanum))
+        {
+            continue;
+        }
+
+        if (!dma_reserve(ws2811, dmanum))
+        {
+            return dmanum;
+        }
     }
+
+    return -1;
 }
 
 /**
- * Initialize the application selected GPIO pins for PWM/PCM operation.
+ * Calculate how long the serializer takes to clock out a number of DMA bytes.
+ * Each PWM channel in use shifts out its own word of the interleaved buffer in parallel.
  *
- * @param    ws2811  ws2811 instance pointer.
+ * @param    ws2811    ws2811 instance pointer.
+ * @param    bytes     Number of bytes sent by the DMA.
+ * @param    clk_freq  Serializer clock in Hz.
  *
- * @returns  0 on success, -1 on unsupported pin
+ * @returns  Transfer time in microseconds.
  */
-static int gpio_init(ws2811_t *ws2811)
+static uint64_t dma_transfer_time(ws2811_t *ws2811, uint32_t bytes, uint32_t clk_freq)
 {
-    volatile gpio_t *gpio = ws2811->device->gpio;
-    int chan;
-    int altnum;
+    uint64_t bits = (uint64_t)bytes * 8 / ws2811->device->fifo_chans;
+
+    return (bits * 1000000) / clk_freq;
+}
+
+/**
+ * Check whether frames are sent through the DMA frame queue, which is also
+ * used to loop the last frame for continuous refresh.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  1 if queueing, 0 otherwise.
+ */
+static int queue_mode(ws2811_t *ws2811)
+{
+    return (ws2811->queue_frames > 0) || (ws2811->refresh_rate > 0);
+}
+
+/**
+ * Calculate the number of zero bytes to send after each queued frame so that
+ * frames start frame_interval apart, or refresh_rate times a second if that
+ * is not set, but at least LED_RESET_WAIT_TIME apart.
+ *
+ * @param    ws2811    ws2811 instance pointer.
+ * @param    clk_freq  Serializer clock in Hz.
+ *
+ * @returns  Gap size in bytes, a whole number of words for every channel.
+ */
+static uint32_t frame_gap_bytes(ws2811_t *ws2811, uint32_t clk_freq)
+{
+    uint32_t word_bytes = sizeof(uint32_t) * ws2811->device->fifo_chans;
+    uint64_t frame_time = dma_transfer_time(ws2811, frame_bytes(ws2811), clk_freq);
+    uint64_t interval = ws2811->frame_interval;
+    uint64_t bytes;
+
+    if (!interval && ws2811->refresh_rate)
+    {
+        interval = 1000000 / ws2811->refresh_rate;
+    }
+
+    if (interval < frame_time + LED_RESET_WAIT_TIME)
+    {
+        interval = frame_time + LED_RESET_WAIT_TIME;
+    }
+
+    bytes = ((interval - frame_time) * clk_freq) / 8000000;
+    bytes *= word_bytes / sizeof(uint32_t);
+
+    return (bytes + word_bytes - 1) & ~(uint64_t)(word_bytes - 1);
+}
+
+/**
+ * Calculate the number of zero bytes at the start of a looping frame's gap
+ * that latch it, after which the rest of the gap may be skipped for a new
+ * frame.
+ *
+ * @param    ws2811    ws2811 instance pointer.
+ * @param    clk_freq  Serializer clock in Hz.
+ *
+ * @returns  Reset size in bytes, a whole number of words for every channel.
+ */
+static uint32_t frame_reset_bytes(ws2811_t *ws2811, uint32_t clk_freq)
+{
+    uint32_t word_bytes = sizeof(uint32_t) * ws2811->device->fifo_chans;
+    uint64_t bytes = ((uint64_t)LED_RESET_WAIT_TIME * clk_freq) / 8000000;
+
+    bytes *= word_bytes / sizeof(uint32_t);
+
+    return (bytes + word_bytes - 1) & ~(uint64_t)(word_bytes - 1);
+}
+
+/*
+ * Control block addresses are kept as bus addresses throughout.  The helpers
+ * below translate them for DMA4, which takes physical addresses >> 5 for
+ * control blocks and 40 bit physical addresses for data.  The ACTIVE, END,
+ * INT and PAUSED bits are in the same place in both CS registers.
+ */
+
+static uint32_t dma_cb_link(ws2811_device_t *device, uint32_t bus_addr)
+{
+    if (!device->dma4 || !bus_addr)
+    {
+        return bus_addr;
+    }
+
+    return BUS_TO_PHYS(bus_addr) >> 5;
+}
+
+static uint32_t dma_cb_unlink(ws2811_device_t *device, uint32_t cb)
+{
+    if (!device->dma4 || !cb)
+    {
+        return cb;
+    }
+
+    return (cb << 5) - BUS_TO_PHYS(device->mbox.bus_addr) + device->mbox.bus_addr;
+}
+
+/**
+ * Get the control block the DMA is currently running.
+ *
+ * @param    device  ws2811 device pointer.
+ *
+ * @returns  Bus address of the control block, 0 if none is loaded.
+ */
+static uint32_t dma_current_cb(ws2811_device_t *device)
+{
+    return dma_cb_unlink(device, device->dma->conblk_ad);
+}
+
+/**
+ * Get the copy of the next control block address the DMA loaded from the
+ * current one.
+ *
+ * @param    device  ws2811 device pointer.
+ *
+ * @returns  Bus address of the next control block, 0 if the chain ends.
+ */
+static uint32_t dma_next_cb(ws2811_device_t *device)
+{
+    if (device->dma4)
+    {
+        return dma_cb_unlink(device, ((volatile dma4_t *)device->dma)->next_cb);
+    }
+
+    return device->dma->nextconbk;
+}
+
+/**
+ * Patch the copy of the next control block address in the DMA registers.
+ * Only valid while the DMA is paused.
+ *
+ * @param    device    ws2811 device pointer.
+ * @param    bus_addr  Bus address of the next control block, 0 to end.
+ *
+ * @returns  None
+ */
+static void dma_set_next_cb(ws2811_device_t *device, uint32_t bus_addr)
+{
+    if (device->dma4)
+    {
+        ((volatile dma4_t *)device->dma)->next_cb = dma_cb_link(device, bus_addr);
+        return;
+    }
+
+    device->dma->nextconbk = bus_addr;
+}
+
+/**
+ * CS register value that runs the DMA at full priority, without the ACTIVE bit.
+ *
+ * @param    device  ws2811 device pointer.
+ *
+ * @returns  CS register value.
+ */
+static uint32_t dma_run_cs(ws2811_device_t *device)
+{
+    if (device->dma4)
+    {
+        return RPI_DMA4_CS_WAIT_FOR_WRITES |
+               RPI_DMA4_CS_PANIC_QOS(15) |
+               RPI_DMA4_CS_QOS(15);
+    }
+
+    return RPI_DMA_CS_WAIT_OUTSTANDING_WRITES |
+           RPI_DMA_CS_PANIC_PRIORITY(15) |
+           RPI_DMA_CS_PRIORITY(15);
+}
+
+/**
+ * Check the DMA for a bus error.
+ *
+ * @param    device  ws2811 device pointer.
+ *
+ * @returns  1 if the DMA stopped on an error, 0 otherwise.
+ */
+static int dma_error(ws2811_device_t *device)
+{
+    return (device->dma->cs & (device->dma4 ? RPI_DMA4_CS_ERROR : RPI_DMA_CS_ERROR)) ? 1 : 0;
+}
+
+/**
+ * Get the DMA debug register for error reports.
+ *
+ * @param    device  ws2811 device pointer.
+ *
+ * @returns  Debug register value.
+ */
+static uint32_t dma_debug(ws2811_device_t *device)
+{
+    if (device->dma4)
+    {
+        return ((volatile dma4_t *)device->dma)->debug;
+    }
+
+    return device->dma->debug;
+}
+
+/**
+ * Program a control block moving data into the peripheral FIFO.
+ *
+ * @param    device  ws2811 device pointer.
+ * @param    cb      Control block to fill in.
+ * @param    src     Bus address of the data.
+ * @param    inc     Increment the source address, otherwise resend the same word.
+ * @param    len     Number of bytes to move.
+ *
+ * @returns  None
+ */
+static void dma_cb_fill(ws2811_device_t *device, volatile dma_cb_t *cb, uint32_t src, int inc, uint32_t len)
+{
+    if (device->dma4)
+    {
+        volatile dma4_cb_t *cb4 = (volatile dma4_cb_t *)cb;
+
+        cb4->ti = RPI_DMA4_TI_WAIT_RESP |                // wait for write complete
+                  RPI_DMA4_TI_D_DREQ |                   // user peripheral flow control
+                  RPI_DMA4_TI_PERMAP(device->dma_permap);
+        cb4->src = BUS_TO_PHYS(src);
+        cb4->srci = RPI_DMA4_XI_SIZE_32 | (inc ? RPI_DMA4_XI_INC : 0);
+        cb4->dest = device->dma_dest;
+        cb4->desti = RPI_DMA4_XI_SIZE_32 | RPI_DMA4_XI_ADDR_HIGH(RPI_DMA4_PERIPH_HIGH);
+        cb4->len = len;
+        cb4->next_cb = 0;
+        cb4->resvd_0x1c = 0;
+        return;
+    }
+
+    cb->ti = RPI_DMA_TI_NO_WIDE_BURSTS |                 // 32-bit transfers
+             RPI_DMA_TI_WAIT_RESP |                      // wait for write complete
+             RPI_DMA_TI_DEST_DREQ |                      // user peripheral flow control
+             RPI_DMA_TI_PERMAP(device->dma_permap) |
+             (inc ? RPI_DMA_TI_SRC_INC : 0);             // Increment src addr
+    cb->source_ad = src;
+    cb->dest_ad = device->dma_dest;
+    cb->txfr_len = len;
+    cb->stride = 0;
+    cb->nextconbk = 0;
+}
+
+/**
+ * Fill a legacy 2D control block sending overlapping pairs of words to the
+ * FIFO, stepping the source back a word after each pair.
+ *
+ * @param    device  ws2811 device pointer.
+ * @param    cb      Control block to fill.
+ * @param    src     Bus address of the first word.
+ * @param    rows    Number of word pairs.
+ *
+ * @returns  None
+ */
+static void dma_cb_fill_rows(ws2811_device_t *device, volatile dma_cb_t *cb, uint32_t src, uint32_t rows)
+{
+    dma_cb_fill(device, cb, src, 1, 0);
+
+    cb->ti |= RPI_DMA_TI_TDMODE;
+    cb->txfr_len = RPI_DMA_TXFR_LEN_YLENGTH(rows) |
+                   RPI_DMA_TXFR_LEN_XLENGTH(2 * sizeof(uint32_t));
+    cb->stride = RPI_DMA_STRIDE_S_STRIDE(-(int)sizeof(uint32_t));
+}
+
+static void dma_cb_set_len(ws2811_device_t *device, volatile dma_cb_t *cb, uint32_t len)
+{
+    if (device->dma4)
+    {
+        ((volatile dma4_cb_t *)cb)->len = len;
+        return;
+    }
+
+    cb->txfr_len = len;
+}
+
+static void dma_cb_set_next(ws2811_device_t *device, volatile dma_cb_t *cb, uint32_t bus_addr)
+{
+    if (device->dma4)
+    {
+        ((volatile dma4_cb_t *)cb)->next_cb = dma_cb_link(device, bus_addr);
+        return;
+    }
+
+    cb->nextconbk = bus_addr;
+}
+
+/**
+ * Fill in the control blocks of every frame buffer.  The data blocks send the
+ * rendered data in pieces the channel can transfer, the optional gap blocks
+ * resend the same zero word to keep the line low for the inter-frame gap.
+ * Every frame ends the chain until it is linked to the next one by the queue.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void setup_frames(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    int i, j;
+
+    device->dma_bytes = frame_bytes(ws2811);
+
+    for (i = 0; i < device->frame_count; i++)
+    {
+        ws2811_frame_t *frame = &device->frames[i];
+        volatile dma_cb_t *dma_cb = frame->dma_cb;
+        uint32_t head = device->tail_words ? device->head_words * sizeof(uint32_t) * RPI_PWM_CHANNELS :
+                                             device->frame_size;
+        uint32_t data = head;
+        uint32_t rows = device->tail_words;
+        uint32_t reset = device->reset_bytes;
+        uint32_t gap = device->gap_bytes - reset;
+
+        for (j = 0; j < device->frame_cbs; j++)
+        {
+            if (j > 0)
+            {
+                dma_cb_set_next(device, &dma_cb[j - 1], addr_to_bus(device, &dma_cb[j]));
+            }
+
+            if (j < device->head_cbs)
+            {
+                uint32_t len = data > device->txfr_max ? device->txfr_max : data;
+
+                dma_cb_fill(device, &dma_cb[j], addr_to_bus(device, frame->pxl_raw + (head - data)),
+                            1, len);
+                data -= len;
+            }
+            else if (j < device->data_cbs)
+            {
+                uint32_t len = rows > RPI_DMA_TXFR_LEN_YLENGTH_MAX ? RPI_DMA_TXFR_LEN_YLENGTH_MAX : rows;
+                uint32_t row = device->tail_words - rows;
+
+                // Only the longer channel's words are stored past the head
+                dma_cb_fill_rows(device, &dma_cb[j],
+                                 addr_to_bus(device, frame->pxl_raw + head + row * sizeof(uint32_t)), len);
+                rows -= len;
+            }
+            else if (reset)
+            {
+                uint32_t len = reset > device->txfr_max ? device->txfr_max : reset;
+
+                dma_cb_fill(device, &dma_cb[j], device->zero_addr, 0, len);
+                reset -= len;
+            }
+            else
+            {
+                uint32_t len = gap > device->txfr_max ? device->txfr_max : gap;
+
+                // Resend the same zero word
+                dma_cb_fill(device, &dma_cb[j], device->zero_addr, 0, len);
+                gap -= len;
+            }
+        }
+    }
+}
+
+/**
+ * Setup the PWM controller in serial mode on the channels in use using DMA to feed the PWM FIFO.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static int setup_pwm(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    volatile dma_t *dma = device->dma;
+    volatile pwm_t *pwm = device->pwm;
+    uint32_t ctl = 0, pwen = 0;
+
+    stop_pwm(ws2811);
+
+    // Setup the Clock - 3 clocks/tick
+    clk_setup(ws2811);
+
+    // Setup the PWM, use delays as the block is rumored to lock up without them.  Make
+    // sure to use a high enough priority to avoid any FIFO underruns, especially if
+    // the CPU is busy doing lots of memory accesses, or another DMA controller is
+    // busy.  The FIFO will clock out data at a much slower rate (2.6Mhz max), so
+    // the odds of a DMA priority boost are extremely low.
+
+    pwm->rng1 = 32;  // 32-bits per word to serialize
+    usleep(10);
+    pwm->ctl = RPI_PWM_CTL_CLRF1;
+    usleep(10);
+    pwm->dmac = RPI_PWM_DMAC_ENAB | RPI_PWM_DMAC_PANIC(7) | RPI_PWM_DMAC_DREQ(3);
+    usleep(10);
+    // Only the channels in use take words from the FIFO
+    if (device->chan_first == 0)
+    {
+        ctl |= RPI_PWM_CTL_USEF1 | RPI_PWM_CTL_MODE1;
+        pwen |= RPI_PWM_CTL_PWEN1;
+    }
+    if ((device->chan_first == 1) || (device->fifo_chans == 2))
+    {
+        ctl |= RPI_PWM_CTL_USEF2 | RPI_PWM_CTL_MODE2;
+        pwen |= RPI_PWM_CTL_PWEN2;
+    }
+    pwm->ctl = ctl;
+    if (ws2811->channel[0].invert)
+    {
+        pwm->ctl |= RPI_PWM_CTL_POLA1;
+    }
+    if (ws2811->channel[1].invert)
+    {
+        pwm->ctl |= RPI_PWM_CTL_POLA2;
+    }
+    usleep(10);
+    pwm->ctl |= pwen;
+
+    // Initialize the DMA control blocks
+    device->dma_permap = 5;                   // PWM peripheral
+    device->dma_dest = (uintptr_t)&((pwm_t *)PWM_PERIPH_PHYS)->fif1;
+    setup_frames(ws2811);
+
+    dma->cs = 0;
+    if (!device->dma4)
+    {
+        dma->txfr_len = 0;
+    }
+
+    return 0;
+}
+
+/**
+ * Setup the PCM controller with one 32-bit channel in a 32-bit frame using DMA to feed the PCM FIFO.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static int setup_pcm(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    volatile dma_t *dma = device->dma;
+    volatile pcm_t *pcm = device->pcm;
+
+    stop_pcm(ws2811);
+
+    // Setup the PCM Clock - 3 clocks/tick
+    clk_setup(ws2811);
+
+    // Setup the PCM, use delays as the block is rumored to lock up without them.  Make
+    // sure to use a high enough priority to avoid any FIFO underruns, especially if
+    // the CPU is busy doing lots of memory accesses, or another DMA controller is
+    // busy.  The FIFO will clock out data at a much slower rate (2.6Mhz max), so
+    // the odds of a DMA priority boost are extremely low.
+
+    pcm->cs = RPI_PCM_CS_EN;            // Enable PCM hardware
+    pcm->mode = (RPI_PCM_MODE_FLEN(31) | RPI_PCM_MODE_FSLEN(1));
+                // Framelength 32, clock enabled, frame sync pulse
+    pcm->txc = RPI_PCM_TXC_CH1WEX | RPI_PCM_TXC_CH1EN | RPI_PCM_TXC_CH1POS(0) | RPI_PCM_TXC_CH1WID(8);
+               // Single 32-bit channel
+    pcm->cs |= RPI_PCM_CS_TXCLR;        // Reset transmit fifo
+    usleep(10);
+    pcm->cs |= RPI_PCM_CS_DMAEN;         // Enable DMA DREQ
+    pcm->dreq = (RPI_PCM_DREQ_TX(0x3F) | RPI_PCM_DREQ_TX_PANIC(0x10)); // Set FIFO tresholds
+
+    // Initialize the DMA control blocks
+    device->dma_permap = 2;                   // PCM TX peripheral
+    device->dma_dest = (uintptr_t)&((pcm_t *)PCM_PERIPH_PHYS)->fifo;
+    setup_frames(ws2811);
+
+    dma->cs = 0;
+    if (!device->dma4)
+    {
+        dma->txfr_len = 0;
+    }
+
+    return 0;
+}
+
+/**
+ * Start the DMA feeding the PWM FIFO.  This will stream the entire DMA buffer out of both
+ * PWM channels.  The channel is only reset, which needs a few sleeps, on the first
+ * start and after an error.  Otherwise it is idle and can be started right away.
+ *
+ * @param    ws2811       ws2811 instance pointer.
+ * @param    dma_cb_addr  Bus address of the first control block to run.
+ *
+ * @returns  None
+ */
+static void dma_start(ws2811_t *ws2811, uint32_t dma_cb_addr)
+{
+    ws2811_device_t *device = ws2811->device;
+    volatile dma_t *dma = device->dma;
+    volatile pcm_t *pcm = device->pcm;
+
+    if (device->dma_ready && !(dma->cs & RPI_DMA_CS_ACTIVE) && !dma_error(device))
+    {
+        // Idle after a clean finish, clearing the status is enough to reuse it
+        dma->cs = RPI_DMA_CS_INT | RPI_DMA_CS_END;
+        if (device->dma4)
+        {
+            ((volatile dma4_t *)dma)->cb = dma_cb_link(device, dma_cb_addr);
+        }
+        else
+        {
+            dma->conblk_ad = dma_cb_addr;
+        }
+    }
+    else if (device->dma4)
+    {
+        volatile dma4_t *dma4 = (volatile dma4_t *)dma;
+
+        dma4->debug = RPI_DMA4_DEBUG_RESET;
+        usleep(10);
+
+        dma4->cs = RPI_DMA4_CS_INT | RPI_DMA4_CS_END;
+        usleep(10);
+
+        dma4->cb = dma_cb_link(device, dma_cb_addr);
+        dma4->debug = 7; // clear debug error flags
+    }
+    else
+    {
+        dma->cs = RPI_DMA_CS_RESET;
+        usleep(10);
+
+        dma->cs = RPI_DMA_CS_INT | RPI_DMA_CS_END;
+        usleep(10);
+
+        dma->conblk_ad = dma_cb_addr;
+        dma->debug = 7; // clear debug error flags
+    }
+    device->dma_ready = 1;
+    dma->cs = dma_run_cs(device) | RPI_DMA_CS_ACTIVE;
+    device->start_ns = get_nanosecond_timestamp();
+
+    if (device->driver_mode == PCM)
+    {
+        pcm->cs |= RPI_PCM_CS_TXON;  // Start transmission
+    }
+
+    // Note when the transfer should be done so ws2811_wait() can sleep until then
+    clock_gettime(CLOCK_MONOTONIC, &device->dma_due);
+    timespec_add_us(&device->dma_due,
+                    dma_transfer_time(ws2811, device->dma_bytes + device->gap_bytes, device->clk_freq));
+}
+
+/**
+ * Initialize the application selected GPIO pins for PWM/PCM operation.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, -1 on unsupported pin
+ */
+static int gpio_init(ws2811_t *ws2811)
+{
+    volatile gpio_t *gpio = ws2811->device->gpio;
+    int chan;
+    int altnum;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        int pinnum = ws2811->channel[chan].gpionum;
+
+        if (pinnum)
+        {
+            switch (ws2811->device->driver_mode)
+            {
+            case PWM:
+                altnum = pwm_pin_alt(chan, pinnum);
+                break;
+            case PCM:
+                altnum = pcm_pin_alt(PCMFUN_DOUT, pinnum);
+                break;
+            default:
+                altnum = -1;
+            }
+
+            if (altnum < 0)
+            {
+                return -1;
+            }
+
+            gpio_function_set(gpio, pinnum, altnum);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Copy an encoded frame from the cached staging buffer to DMA memory.  The
+ * mailbox memory is mapped uncached, so it is written front to back with the
+ * widest stores available instead of memcpy(), which may use byte accesses.
+ *
+ * @param    dst    DMA memory, word aligned.
+ * @param    src    Staging buffer.
+ * @param    bytes  Bytes to copy, a word multiple.
+ *
+ * @returns  None
+ */
+static void stage_copy(volatile uint8_t *dst, const uint8_t *src, uint32_t bytes)
+{
+    uint32_t i = 0;
+
+    // Queued PCM frames can start on an odd word
+    if (((uintptr_t)dst & (sizeof(uint64_t) - 1)) && bytes)
+    {
+        *(volatile uint32_t *)dst = *(const uint32_t *)src;
+        i += sizeof(uint32_t);
+    }
+
+#ifdef __ARM_NEON
+    for (; i + sizeof(uint32x4_t) <= bytes; i += sizeof(uint32x4_t))
+    {
+        vst1q_u32((uint32_t *)(dst + i), vld1q_u32((const uint32_t *)(src + i)));
+    }
+#endif
+
+    for (; i + sizeof(uint64_t) <= bytes; i += sizeof(uint64_t))
+    {
+        uint64_t val;
+
+        memcpy(&val, src + i, sizeof(val));
+        *(volatile uint64_t *)(dst + i) = val;
+    }
+
+    for (; i < bytes; i += sizeof(uint32_t))
+    {
+        *(volatile uint32_t *)(dst + i) = *(const uint32_t *)(src + i);
+    }
+}
+
+/**
+ * Prepare an encoder to turn a channel's LED array into serializer words.
+ *
+ * @param    ws2811   ws2811 instance pointer.
+ * @param    enc      Encoder state to initialize.
+ * @param    channel  Channel to encode.
+ *
+ * @returns  None
+ */
+static void encoder_init(ws2811_t *ws2811, ws2811_encoder_t *enc, const ws2811_channel_t *channel)
+{
+    ws2811_device_t *device = ws2811->device;
+
+    memset(enc, 0, sizeof(*enc));
+    enc->channel = channel;
+    enc->leds = device->encode_leds[channel - ws2811->channel];
+    enc->scale = (channel->brightness & 0xff) + 1;
+
+    // If our shift mask includes the highest nibble, then we have 4 LEDs, RBGW.
+    enc->nibbles = (channel->strip_type & SK6812_SHIFT_WMASK) ? 8 : 6;
+    enc->nibble = enc->nibbles;
+
+    enc->lut = device->symbol_lut;
+    enc->lut_bits = 4 * device->timing->symbols;
+
+    // PWM inverts in hardware, SPI sends the bytes in memory order
+    enc->invert = ((device->driver_mode != PWM) && channel->invert) ? (1 << enc->lut_bits) - 1 : 0;
+    enc->swap = (device->driver_mode == SPI);
+}
+
+/**
+ * Encode the next word of a channel.  Once all LEDs are done the encoder
+ * keeps returning zero words for the reset time and padding, so it can be
+ * called until the whole frame is written.
+ *
+ * @param    enc     Encoder state.
+ *
+ * @returns  Serializer word, byte swapped for SPI.
+ */
+static inline uint32_t encoder_next(ws2811_encoder_t *enc)
+{
+    const ws2811_channel_t *channel = enc->channel;
+    uint32_t word;
+
+    // Keep at least a full word of symbols, a nibble expands to at most 20
+    while (enc->nbits < 32)
+    {
+        uint32_t symbols;
+        uint8_t val;
+
+        if (enc->nibble == enc->nibbles)
+        {
+            ws2811_led_t led;
+
+            if (enc->led >= channel->count)
+            {
+                break;
+            }
+
+            led = enc->leds[enc->led++];
+            enc->rgbw[0] = channel->gamma[(((led >> channel->rshift) & 0xff) * enc->scale) >> 8];
+            enc->rgbw[1] = channel->gamma[(((led >> channel->gshift) & 0xff) * enc->scale) >> 8];
+            enc->rgbw[2] = channel->gamma[(((led >> channel->bshift) & 0xff) * enc->scale) >> 8];
+            enc->rgbw[3] = channel->gamma[(((led >> channel->wshift) & 0xff) * enc->scale) >> 8];
+            enc->nibble = 0;
+        }
+
+        val = enc->rgbw[enc->nibble >> 1];
+        val = (enc->nibble & 1) ? (val & 0xf) : (val >> 4);
+        enc->nibble++;
+
+        symbols = enc->lut[val] ^ enc->invert;
+        enc->bits |= (uint64_t)symbols << (64 - enc->lut_bits - enc->nbits);
+        enc->nbits += enc->lut_bits;
+    }
+
+    word = enc->bits >> 32;
+    enc->bits <<= 32;
+    enc->nbits = enc->nbits > 32 ? enc->nbits - 32 : 0;
+
+    return enc->swap ? htonl(word) : word;
+}
+
+/**
+ * Encode the next words of a channel.
+ *
+ * @param    enc     Encoder state.
+ * @param    dst     Where to write the first word.
+ * @param    stride  Distance in words between consecutive words of the channel.
+ * @param    count   Number of words to write.
+ *
+ * @returns  None
+ */
+static void encoder_words(ws2811_encoder_t *enc, volatile uint32_t *dst, int stride, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        dst[i * stride] = encoder_next(enc);
+    }
+}
+
+/**
+ * Encode both PWM channels together, writing each interleaved pair of words
+ * with one 64-bit store.  The uncached buffer is then filled strictly in
+ * order, which the write buffer handles far better than two strided passes.
+ *
+ * @param    enc     Encoder state for each PWM channel.
+ * @param    dst     Where to write the first pair, 64-bit aligned.
+ * @param    count   Number of word pairs to write.
+ *
+ * @returns  None
+ */
+static void encoder_pairs(ws2811_encoder_t enc[RPI_PWM_CHANNELS], volatile uint64_t *dst, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        uint64_t first = encoder_next(&enc[0]);
+        uint64_t second = encoder_next(&enc[1]);
+
+        // Channel 0 takes the word at the lower address
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        dst[i] = (first << 32) | second;
+#else
+        dst[i] = (second << 32) | first;
+#endif
+    }
+}
+
+/**
+ * Pick the LED arrays for the frame about to be encoded, once, so a buffer
+ * swapped by ws2811_attach_leds() never tears a frame.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void encode_leds_select(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    int chan;
+
+    // Pairs with the release store in ws2811_attach_leds()
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        device->encode_leds[chan] = device->render_leds[chan] ? device->render_leds[chan] :
+                                    __atomic_load_n(&ws2811->channel[chan].leds, __ATOMIC_ACQUIRE);
+    }
+}
+
+/**
+ * Encode words [start, end) of every channel in the FIFO.  Word start must
+ * fall on an LED boundary of each channel, see ENCODE_SPLIT_WORDS.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    raw     Buffer holding the whole frame.
+ * @param    start   First word per channel to encode.
+ * @param    end     Word per channel to stop at.
+ *
+ * @returns  None
+ */
+static void encode_range(ws2811_t *ws2811, volatile uint32_t *raw, int start, int end)
+{
+    ws2811_device_t *device = ws2811->device;
+    int chans = device->fifo_chans;
+    int head = device->tail_words ? device->head_words : end;
+    ws2811_encoder_t enc[RPI_PWM_CHANNELS];
+    int chan;
+
+    for (chan = 0; chan < chans; chan++)
+    {
+        encoder_init(ws2811, &enc[chan], &ws2811->channel[device->chan_first + chan]);
+        enc[chan].led = (uint64_t)start * 32 / (enc[chan].nibbles * enc[chan].lut_bits);
+    }
+
+    if (chans == 1)
+    {
+        encoder_words(&enc[0], raw + start, 1, end - start);
+        return;
+    }
+
+    // PWM channels are interleaved word by word, written a pair at a time
+    if (start < head)
+    {
+        encoder_pairs(enc, (volatile uint64_t *)raw + start, (end < head ? end : head) - start);
+    }
+
+    // The longer channel carries on alone, after a lead word when it is the second
+    if (end > head)
+    {
+        int from = start > head ? start : head;
+
+        chan = device->tail_chan;
+        encoder_words(&enc[chan], raw + (head * chans) + chan + (from - head), 1, end - from);
+    }
+}
+
+/**
+ * Split the frame for the encoder threads.  Every thread, the caller
+ * included, gets a share rounded to ENCODE_SPLIT_WORDS.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    part    Share to work out, 0 for the calling thread.
+ * @param    start   Returns the first word per channel of the share.
+ * @param    end     Returns the word per channel the share stops at.
+ *
+ * @returns  None
+ */
+static void encode_part(ws2811_t *ws2811, int part, int *start, int *end)
+{
+    ws2811_device_t *device = ws2811->device;
+    int words = frame_bytes(ws2811) / sizeof(uint32_t) / device->fifo_chans;
+    int split = ENCODE_SPLIT_WORDS(device->timing->symbols);
+    int parts = device->worker_count + 1;
+    int share = (((words + parts - 1) / parts) + split - 1) / split * split;
+
+    *start = part * share < words ? part * share : words;
+    *end = *start + share < words ? *start + share : words;
+}
+
+/**
+ * Give a thread of the render path the requested SCHED_FIFO priority and CPUs.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    thread  Thread to set up.
+ * @param    cpus    CPU mask to run it on, 0 to leave it.
+ *
+ * @returns  WS2811_RT_xxx bits of the controls that took effect.
+ */
+static uint32_t rt_thread_setup(ws2811_t *ws2811, pthread_t thread, uint32_t cpus)
+{
+    uint32_t status = 0;
+
+    if (ws2811->rt_priority > 0)
+    {
+        struct sched_param param = { .sched_priority = ws2811->rt_priority };
+
+        if (!pthread_setschedparam(thread, SCHED_FIFO, &param))
+        {
+            status |= WS2811_RT_FIFO;
+        }
+    }
+
+    if (cpus)
+    {
+        cpu_set_t set;
+        int cpu;
+
+        CPU_ZERO(&set);
+        for (cpu = 0; cpu < 32; cpu++)
+        {
+            if (cpus & (1U << cpu))
+            {
+                CPU_SET(cpu, &set);
+            }
+        }
+
+        if (!pthread_setaffinity_np(thread, sizeof(set), &set))
+        {
+            status |= WS2811_RT_AFFINITY;
+        }
+    }
+
+    return status;
+}
+
+/**
+ * Lock the library's heap buffers into RAM and touch every page so the
+ * render path takes no page faults.  The DMA memory is pinned already.
+ * Attached LED arrays are only read, they may be read-only mappings or
+ * written by another thread.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  WS2811_RT_xxx bits of the controls that took effect.
+ */
+static uint32_t rt_memory_setup(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    struct
+    {
+        void *addr;
+        size_t len;
+        int shared;
+    } bufs[4 + (3 * RPI_PWM_CHANNELS)] = { { 0 } };
+    uint32_t status = WS2811_RT_LOCKED | WS2811_RT_PREFAULTED;
+    int count = 0;
+    int chan, i;
+
+    bufs[count].addr = device;
+    bufs[count++].len = sizeof(*device);
+    bufs[count].addr = device->frames;
+    bufs[count++].len = sizeof(*device->frames) * device->frame_count;
+    bufs[count].addr = device->stage;
+    bufs[count++].len = device->frame_size;
+    bufs[count].addr = device->workers;
+    bufs[count++].len = sizeof(*device->workers) * device->worker_count;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        ws2811_channel_t *channel = &ws2811->channel[chan];
+
+        bufs[count].addr = channel->leds;
+        bufs[count].shared = !device->leds_owned[chan];
+        bufs[count++].len = sizeof(ws2811_led_t) * channel->count;
+        bufs[count].addr = channel->gamma;
+        bufs[count++].len = 256;
+        bufs[count].addr = device->frame_leds[chan];
+        bufs[count++].len = sizeof(ws2811_led_t) * ((3 * channel->count) + 1);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        volatile uint8_t *page = bufs[i].addr;
+        size_t offset;
+
+        if (!bufs[i].addr || !bufs[i].len)
+        {
+            continue;
+        }
+
+        if (mlock(bufs[i].addr, bufs[i].len))
+        {
+            status &= ~WS2811_RT_LOCKED;
+        }
+
+        if (bufs[i].shared)
+        {
+            for (offset = 0; offset < bufs[i].len; offset += PAGE_SIZE)
+            {
+                (void)page[offset];
+            }
+            (void)page[bufs[i].len - 1];
+            continue;
+        }
+
+        // Write each page back to itself so copy on write faults happen now
+        for (offset = 0; offset < bufs[i].len; offset += PAGE_SIZE)
+        {
+            page[offset] = page[offset];
+        }
+        page[bufs[i].len - 1] = page[bufs[i].len - 1];
+    }
+
+    return status;
+}
+
+/**
+ * Apply the real-time controls once all buffers exist.  The calling thread
+ * is the rendering context unless render_rate hands that to the render thread.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void rt_setup(ws2811_t *ws2811)
+{
+    ws2811->rt_status = 0;
+
+    if (ws2811->rt_lock)
+    {
+        ws2811->rt_status |= rt_memory_setup(ws2811);
+    }
+
+    if (!ws2811->render_rate)
+    {
+        ws2811->rt_status |= rt_thread_setup(ws2811, pthread_self(), ws2811->rt_cpus);
+    }
+}
+
+/**
+ * Encoder thread, encodes its share of each frame the calling thread hands out.
+ *
+ * @param    arg  Worker state.
+ *
+ * @returns  NULL
+ */
+static void *encode_worker(void *arg)
+{
+    ws2811_worker_t *worker = arg;
+    ws2811_t *ws2811 = worker->ws2811;
+    ws2811_device_t *device = ws2811->device;
+    unsigned int gen = 0;
+
+    pthread_mutex_lock(&device->work_lock);
+    while (1)
+    {
+        int start, end;
+
+        while (!device->work_stop && (device->work_gen == gen))
+        {
+            pthread_cond_wait(&device->work_cond, &device->work_lock);
+        }
+        if (device->work_stop)
+        {
+            break;
+        }
+        gen = device->work_gen;
+        pthread_mutex_unlock(&device->work_lock);
+
+        encode_part(ws2811, worker->index + 1, &start, &end);
+        encode_range(ws2811, device->work_raw, start, end);
+
+        pthread_mutex_lock(&device->work_lock);
+        if (++device->work_done == device->worker_count)
+        {
+            pthread_cond_signal(&device->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&device->work_lock);
+
+    return NULL;
+}
+
+/**
+ * Start the encoder threads requested by encode_threads, each pinned to the
+ * next CPU in encode_cpus when a mask is given.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, -1 if a thread couldn't be started.
+ */
+static int encode_workers_start(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    int cpu = 0;
+    int i;
+
+    if (ws2811->encode_threads <= 1)
+    {
+        return 0;
+    }
+
+    device->workers = calloc(ws2811->encode_threads - 1, sizeof(*device->workers));
+    if (!device->workers)
+    {
+        return -1;
+    }
+
+    pthread_mutex_init(&device->work_lock, NULL);
+    pthread_cond_init(&device->work_cond, NULL);
+    pthread_cond_init(&device->done_cond, NULL);
+
+    for (i = 0; i < ws2811->encode_threads - 1; i++)
+    {
+        ws2811_worker_t *worker = &device->workers[i];
+
+        worker->ws2811 = ws2811;
+        worker->index = i;
+        if (pthread_create(&worker->thread, NULL, encode_worker, worker))
+        {
+            return -1;
+        }
+        device->worker_count++;
+
+        // Encoder threads share the render path's priority, not its CPUs
+        rt_thread_setup(ws2811, worker->thread, 0);
+
+        if (ws2811->encode_cpus)
+        {
+            cpu_set_t cpus;
+
+            while (!(ws2811->encode_cpus & (1U << cpu)))
+            {
+                cpu = (cpu + 1) % 32;
+            }
+
+            CPU_ZERO(&cpus);
+            CPU_SET(cpu, &cpus);
+            pthread_setaffinity_np(worker->thread, sizeof(cpus), &cpus);
+            cpu = (cpu + 1) % 32;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Stop and join the encoder threads.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void encode_workers_stop(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    int i;
+
+    if (!device->workers)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&device->work_lock);
+    device->work_stop = 1;
+    pthread_cond_broadcast(&device->work_cond);
+    pthread_mutex_unlock(&device->work_lock);
+
+    for (i = 0; i < device->worker_count; i++)
+    {
+        pthread_join(device->workers[i].thread, NULL);
+    }
+
+    pthread_cond_destroy(&device->done_cond);
+    pthread_cond_destroy(&device->work_cond);
+    pthread_mutex_destroy(&device->work_lock);
+    free(device->workers);
+    device->workers = NULL;
+    device->worker_count = 0;
+}
+
+/**
+ * Stop and join the render thread, the frame it is sending is finished first.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void render_thread_stop(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+
+    if (!device->render_running)
+    {
+        return;
+    }
+
+    atomic_store(&device->render_stop, 1);
+    pthread_join(device->render_tid, NULL);
+    device->render_running = 0;
+}
+
+/**
+ * Allocate the three frame buffers per channel published with
+ * ws2811_frame_publish().  Buffer 0 starts as the one the application fills,
+ * 1 in the middle and 2 as the one being sent.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, -1 if out of memory.
+ */
+static int frame_buffers_alloc(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    int chan;
+
+    if (!ws2811->render_rate)
+    {
+        return 0;
+    }
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        ws2811_channel_t *channel = &ws2811->channel[chan];
+
+        device->frame_leds[chan] = calloc((3 * channel->count) + 1, sizeof(ws2811_led_t));
+        if (!device->frame_leds[chan])
+        {
+            return -1;
+        }
+    }
+
+    device->frame_back = 0;
+    atomic_init(&device->frame_state, 1);
+    device->frame_front = 2;
+
+    return 0;
+}
+
+/**
+ * Render the user supplied LED arrays into a whole DMA (or SPI) buffer.
+ * With encoder threads the frame is split between them and the calling
+ * thread, which returns once all of them are done.
+ *
+ * @param    ws2811   ws2811 instance pointer.
+ * @param    pxl_raw  Buffer to render into.
+ *
+ * @returns  None
+ */
+static void render_encode(ws2811_t *ws2811, volatile uint8_t *pxl_raw)
+{
+    ws2811_device_t *device = ws2811->device;
+    volatile uint32_t *raw = (volatile uint32_t *)pxl_raw;
+    int start, end;
+
+    if (device->stage)
+    {
+        raw = (volatile uint32_t *)device->stage;
+    }
+
+    encode_leds_select(ws2811);
+
+    if (device->worker_count)
+    {
+        pthread_mutex_lock(&device->work_lock);
+        device->work_raw = raw;
+        device->work_done = 0;
+        device->work_gen++;
+        pthread_cond_broadcast(&device->work_cond);
+        pthread_mutex_unlock(&device->work_lock);
+    }
+
+    encode_part(ws2811, 0, &start, &end);
+    encode_range(ws2811, raw, start, end);
+
+    if (device->worker_count)
+    {
+        pthread_mutex_lock(&device->work_lock);
+        while (device->work_done < device->worker_count)
+        {
+            pthread_cond_wait(&device->done_cond, &device->work_lock);
+        }
+        pthread_mutex_unlock(&device->work_lock);
+    }
+
+    if (device->stage)
+    {
+        stage_copy(pxl_raw, device->stage, device->frame_size);
+    }
+}
+
+/**
+ * Clear the whole DMA allocation, control blocks and all frame buffers.  Uses
+ * word stores as the memory is mapped uncached.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void dma_raw_init(ws2811_t *ws2811)
+{
+    volatile uint32_t *raw = (uint32_t *)ws2811->device->mbox.virt_addr;
+    uint32_t i;
+
+    for (i = 0; i < ws2811->device->mbox.size / sizeof(uint32_t); i++)
+    {
+        raw[i] = 0x0;
+    }
+}
+
+/**
+ * Work out the frame buffers and control blocks for the current LED counts,
+ * timing and driver options.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, < 0 if the options can't be combined.
+ */
+static ws2811_return_t frame_layout(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+
+    device->frame_loop = 0;
+    device->gap_bytes = 0;
+    device->reset_bytes = 0;
+    device->stream_words = 0;
+    device->head_words = 0;
+    device->tail_words = 0;
+
+    // One frame buffer, a second one to encode into while the first is sent
+    // once asked for, or one per queue entry each followed by its gap
+    device->frame_count = device->frame_pair ? 2 : 1;
+    device->frame_size = frame_bytes(ws2811);
+    if (queue_mode(ws2811))
+    {
+        device->frame_count = ws2811->queue_frames;
+        if (ws2811->refresh_rate > 0)
+        {
+            // Room for the looping frame and the one replacing it
+            device->frame_loop = 1;
+            if (device->frame_count < 2)
+            {
+                device->frame_count = 2;
+            }
+        }
+        device->gap_bytes = frame_gap_bytes(ws2811, device->clk.freq);
+
+        // Only refreshing, a new frame can follow the reset instead of the whole gap
+        if (device->frame_loop && !ws2811->frame_interval)
+        {
+            device->reset_bytes = frame_reset_bytes(ws2811, device->clk.freq);
+            if (device->reset_bytes >= device->gap_bytes)
+            {
+                device->reset_bytes = 0;
+            }
+        }
+    }
+
+    // Streaming cycles the DMA through a ring of short segments instead
+    if (ws2811->stream_leds > 0)
+    {
+        int chans = device->fifo_chans;
+        int max_words = device->txfr_max / sizeof(uint32_t) / chans;
+
+        if (queue_mode(ws2811))
+        {
+            return WS2811_ERROR_NOT_SUPPORTED;
+        }
+
+        // 8 bits per color byte, one word per 32 symbols
+        device->stream_words = (ws2811->stream_leds * LED_COLOURS * 8 * device->timing->symbols) / 32;
+        if (device->stream_words > max_words)
+        {
+            device->stream_words = max_words;
+        }
+
+        device->frame_count = STREAM_SEGMENTS;
+        device->frame_size = device->stream_words * sizeof(uint32_t) * chans;
+    }
+
+    // Let the longer PWM channel finish alone rather than pad the shorter one
+    if (!device->stream_words)
+    {
+        pwm_tail_setup(ws2811);
+    }
+
+    device->head_cbs = (device->frame_size + device->txfr_max - 1) / device->txfr_max;
+    device->data_cbs = device->head_cbs;
+    if (device->tail_words)
+    {
+        device->head_cbs = (device->head_words * sizeof(uint32_t) * RPI_PWM_CHANNELS +
+                            device->txfr_max - 1) / device->txfr_max;
+        device->data_cbs = device->head_cbs +
+                           (device->tail_words + RPI_DMA_TXFR_LEN_YLENGTH_MAX - 1) / RPI_DMA_TXFR_LEN_YLENGTH_MAX;
+    }
+    device->frame_cbs = device->data_cbs +
+                        (device->reset_bytes + device->txfr_max - 1) / device->txfr_max +
+                        (device->gap_bytes - device->reset_bytes + device->txfr_max - 1) / device->txfr_max;
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Bytes of DMA memory the current frame layout needs.  The control blocks
+ * come first for alignment followed by the gap zero word and the frames.
+ *
+ * @param    device  ws2811 device pointer.
+ *
+ * @returns  Size rounded up to a page multiple.
+ */
+static uint32_t dma_mem_size(ws2811_device_t *device)
+{
+    uint32_t size = ((device->frame_count * device->frame_cbs) + 1) * sizeof(dma_cb_t) +
+                    device->frame_count * device->frame_size;
+
+    return (size + (PAGE_SIZE - 1)) & ~(PAGE_SIZE - 1);
+}
+
+/**
+ * Allocate, lock and map mbox.size bytes of VideoCore memory for the DMA.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, < 0 on failure.
+ */
+static ws2811_return_t dma_mem_alloc(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+
+    device->mbox.mem_ref = mem_alloc(device->mbox.handle, device->mbox.size, PAGE_SIZE,
+                                     ws2811->rpi_hw->videocore_base == 0x40000000 ? 0xC : 0x4);
+    if (device->mbox.mem_ref == 0)
+    {
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+
+    device->mbox.bus_addr = mem_lock(device->mbox.handle, device->mbox.mem_ref);
+    if (device->mbox.bus_addr == (uint32_t) ~0UL)
+    {
+       mem_free(device->mbox.handle, device->mbox.mem_ref);
+       device->mbox.mem_ref = 0;
+       return WS2811_ERROR_MEM_LOCK;
+    }
+
+    device->mbox.virt_addr = mapmem(BUS_TO_PHYS(device->mbox.bus_addr), device->mbox.size, DEV_MEM);
+    if (!device->mbox.virt_addr)
+    {
+        mem_unlock(device->mbox.handle, device->mbox.mem_ref);
+        mem_free(device->mbox.handle, device->mbox.mem_ref);
+        device->mbox.mem_ref = 0;
+        return WS2811_ERROR_MMAP;
+    }
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Unmap, unlock and free the DMA memory, the mailbox itself stays open.
+ *
+ * @param    device  ws2811 device pointer.
+ *
+ * @returns  None
+ */
+static void dma_mem_free(ws2811_device_t *device)
+{
+    videocore_mbox_t *mbox = &device->mbox;
+
+    if (!mbox->virt_addr)
+    {
+        return;
+    }
+
+    unmapmem(mbox->virt_addr, mbox->size);
+    mem_unlock(mbox->handle, mbox->mem_ref);
+    mem_free(mbox->handle, mbox->mem_ref);
+    mbox->virt_addr = NULL;
+    mbox->mem_ref = 0;
+}
+
+/**
+ * Point the frames at their control blocks and buffers in the DMA memory.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void frames_place(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    int i;
+
+    for (i = 0; i < device->frame_count; i++)
+    {
+        ws2811_frame_t *frame = &device->frames[i];
+        dma_cb_t *cbs = (dma_cb_t *)device->mbox.virt_addr;
+
+        frame->dma_cb = &cbs[i * device->frame_cbs];
+        frame->last_cb = &frame->dma_cb[device->frame_cbs - 1];
+        frame->reset_cb = NULL;
+        if (device->reset_bytes)
+        {
+            frame->reset_cb = &frame->dma_cb[device->data_cbs - 1 +
+                                             (device->reset_bytes + device->txfr_max - 1) / device->txfr_max];
+        }
+        frame->pxl_raw = (uint8_t *)&cbs[(device->frame_count * device->frame_cbs) + 1] +
+                         i * device->frame_size;
+
+        // Cache the DMA control block bus address
+        frame->dma_cb_addr = addr_to_bus(device, frame->dma_cb);
+    }
+    device->zero_addr = addr_to_bus(device, (dma_cb_t *)device->mbox.virt_addr +
+                                            (device->frame_count * device->frame_cbs));
+
+    device->dma_cb = device->frames[0].dma_cb;
+    device->dma_cb_addr = device->frames[0].dma_cb_addr;
+    device->pxl_raw = device->frames[0].pxl_raw;
+    device->frame_cur = 0;
+    device->frame_prepared = 0;
+}
+
+/**
+ * Initialize the PCM DMA buffer with all zeros.
+ * The DMA buffer length is assumed to be a word multiple.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+void pcm_raw_init(ws2811_t *ws2811)
+{
+    volatile uint32_t *pxl_raw = (uint32_t *)ws2811->device->pxl_raw;
+    int wordcount = frame_bytes(ws2811) / sizeof(uint32_t);
+    int i;
+
+    for (i = 0; i < wordcount; i++)
+    {
+        pxl_raw[i] = 0x0;
+    }
+}
+
+/**
+ * Cleanup previously allocated device memory and buffers.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+void ws2811_cleanup(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    int chan;
+
+    render_thread_stop(ws2811);
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        if (device->frame_leds[chan])
+        {
+            free(device->frame_leds[chan]);
+        }
+        device->frame_leds[chan] = NULL;
+        device->render_leds[chan] = NULL;
+        device->encode_leds[chan] = NULL;
+
+        if (ws2811->channel[chan].leds && device->leds_owned[chan])
+        {
+            free(ws2811->channel[chan].leds);
+        }
+        ws2811->channel[chan].leds = NULL;
+        device->leds_owned[chan] = 0;
+        if (ws2811->channel[chan].gamma)
+        {
+            free(ws2811->channel[chan].gamma);
+        }
+        ws2811->channel[chan].gamma = NULL;
+    }
+
+    if (device->frames)
+    {
+        free(device->frames);
+    }
+
+    encode_workers_stop(ws2811);
+
+    if (device->stage)
+    {
+        free(device->stage);
+    }
+
+    if (device->mbox.handle != -1)
+    {
+        dma_mem_free(device);
+        mbox_close(device->mbox.handle);
+
+        device->mbox.handle = -1;
+    }
+
+    if (device && (device->spi_fd > 0))
+    {
+        close(device->spi_fd);
+    }
+
+    if (device && (device->timer_fd >= 0))
+    {
+        close(device->timer_fd);
+    }
+
+    if (device && (device->dma_lock_fd >= 0))
+    {
+        close(device->dma_lock_fd);
+    }
+
+    if (device) {
+        free(device);
+    }
+    ws2811->device = NULL;
+}
+
+static int set_driver_mode(ws2811_t *ws2811, int gpionum)
+{
+    int gpionum2;
+
+    if (gpionum == 18 || gpionum == 12) {
+        ws2811->device->driver_mode = PWM;
+        // Check gpio for PWM1 (2nd channel) is OK if used
+        gpionum2 = ws2811->channel[1].gpionum;
+        if (gpionum2 == 0 || gpionum2 == 13 || gpionum2 == 19) {
+            return 0;
+        }
+    }
+    else if (gpionum == 21 || gpionum == 31) {
+        ws2811->device->driver_mode = PCM;
+    }
+    else if (gpionum == 10) {
+        ws2811->device->driver_mode = SPI;
+    }
+    else {
+        fprintf(stderr, "gpionum %d not allowed\n", gpionum);
+        return -1;
+    }
+    // For PCM and SPI zero the 2nd channel
+    memset(&ws2811->channel[1], 0, sizeof(ws2811_channel_t));
+
+    return 0;
+}
+
+static int check_hwver_and_gpionum(ws2811_t *ws2811)
+{
+    const rpi_hw_t *rpi_hw;
+    int hwver, gpionum;
+    int gpionums_B1[] = { 10, 18, 21 };
+    int gpionums_B2[] = { 10, 18, 31 };
+    int gpionums_40p[] = { 10, 12, 18, 21};
+    int i;
+
+    rpi_hw = ws2811->rpi_hw;
+    hwver = rpi_hw->hwver & 0x0000ffff;
+    gpionum = ws2811->channel[0].gpionum;
+    if (hwver < 0x0004)  // Model B Rev 1
+    {
+        for ( i = 0; i < (int)(sizeof(gpionums_B1) / sizeof(gpionums_B1[0])); i++)
+        {
+            if (gpionums_B1[i] == gpionum) {
+                // Set driver mode (PWM, PCM, or SPI)
+                return set_driver_mode(ws2811, gpionum);
+            }
+        }
+    }
+    else if (hwver >= 0x0004 && hwver <= 0x000f)  // Models B Rev2, A
+    {
+        for ( i = 0; i < (int)(sizeof(gpionums_B2) / sizeof(gpionums_B2[0])); i++)
+        {
+            if (gpionums_B2[i] == gpionum) {
+                // Set driver mode (PWM, PCM, or SPI)
+                return set_driver_mode(ws2811, gpionum);
+            }
+        }
+    }
+    else if (hwver >= 0x010) // Models B+, A+, 2B, 3B, Zero Zero-W
+    {
+        if ((ws2811->channel[0].count == 0) && (ws2811->channel[1].count > 0))
+        {
+            // Special case: nothing in channel 0, channel 1 only PWM1 allowed
+            // PWM1 only available on 40 pin GPIO interface
+            gpionum = ws2811->channel[1].gpionum;
+            if ((gpionum == 13) || (gpionum == 19))
+            {
+                ws2811->device->driver_mode = PWM;
+                return 0;
+            }
+            else {
+                return -1;
+            }
+        }
+        for ( i = 0; i < (int)(sizeof(gpionums_40p) / sizeof(gpionums_40p[0])); i++)
+        {
+            if (gpionums_40p[i] == gpionum) {
+                // Set driver mode (PWM, PCM, or SPI)
+                return set_driver_mode(ws2811, gpionum);
+            }
+        }
+    }
+    fprintf(stderr, "Gpio %d is illegal for LED channel 0\n", gpionum);
+    return -1;
+}
+
+static ws2811_return_t spi_init(ws2811_t *ws2811)
+{
+    int spi_fd;
+    static uint8_t mode;
+    static uint8_t bits = 8;
+    uint32_t speed = ws2811->freq * ws2811->device->timing->symbols;
+    ws2811_device_t *device = ws2811->device;
+    uint32_t base = ws2811->rpi_hw->periph_base;
+    int pinnum = ws2811->channel[0].gpionum;
+
+    spi_fd = open("/dev/spidev0.0", O_RDWR);
+    if (spi_fd < 0) {
+        fprintf(stderr, "Cannot open /dev/spidev0.0. spi_bcm2835 module not loaded?\n");
+        return WS2811_ERROR_SPI_SETUP;
+    }
+    device->spi_fd = spi_fd;
+
+    // SPI mode
+    if (ioctl(spi_fd, SPI_IOC_WR_MODE, &mode) < 0)
+    {
+        return WS2811_ERROR_SPI_SETUP;
+    }
+    if (ioctl(spi_fd, SPI_IOC_RD_MODE, &mode) < 0)
+    {
+        return WS2811_ERROR_SPI_SETUP;
+    }
+
+    // Bits per word
+    if (ioctl(spi_fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0)
+    {
+        return WS2811_ERROR_SPI_SETUP;
+    }
+    if (ioctl(spi_fd, SPI_IOC_RD_BITS_PER_WORD, &bits) < 0)
+    {
+        return WS2811_ERROR_SPI_SETUP;
+    }
+
+    // Max speed Hz
+    if (ioctl(spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0)
+    {
+        return WS2811_ERROR_SPI_SETUP;
+    }
+    if (ioctl(spi_fd, SPI_IOC_RD_MAX_SPEED_HZ, &speed) < 0)
+    {
+        return WS2811_ERROR_SPI_SETUP;
+    }
+
+    // Initialize device structure elements to not used
+    // except driver_mode, spi_fd and max_count (already defined when spi_init called)
+    device->pxl_raw = NULL;
+    device->dma = NULL;
+    device->pwm = NULL;
+    device->pcm = NULL;
+    device->dma_cb = NULL;
+    device->dma_cb_addr = 0;
+    device->cm_clk = NULL;
+    device->mbox.handle = -1;
+
+    // Set SPI-MOSI pin
+    device->gpio = mapmem(GPIO_OFFSET + base, sizeof(gpio_t), DEV_GPIOMEM);
+    if (!device->gpio)
+    {
+        return WS2811_ERROR_SPI_SETUP;
+    }
+    gpio_function_set(device->gpio, pinnum, 0);	// SPI-MOSI ALT0
+
+    // Allocate LED buffer
+    ws2811_channel_t *channel = &ws2811->channel[0];
+    channel->leds = malloc(sizeof(ws2811_led_t) * channel->count);
+    if (!channel->leds)
+    {
+        ws2811_cleanup(ws2811);
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+    memset(channel->leds, 0, sizeof(ws2811_led_t) * channel->count);
+    device->leds_owned[0] = 1;
+    device->leds_count[0] = channel->count;
+    if (!channel->strip_type)
+    {
+      channel->strip_type=WS2811_STRIP_RGB;
+    }
+
+    // Set default uncorrected gamma table
+    if (!channel->gamma)
+    {
+      channel->gamma = malloc(sizeof(uint8_t) * 256);
+      int x;
+      for(x = 0; x < 256; x++){
+        channel->gamma[x] = x;
+      }
+    }
+
+    channel->wshift = (channel->strip_type >> 24) & 0xff;
+    channel->rshift = (channel->strip_type >> 16) & 0xff;
+    channel->gshift = (channel->strip_type >> 8)  & 0xff;
+    channel->bshift = (channel->strip_type >> 0)  & 0xff;
+
+    // Allocate SPI transmit buffer (same size as PCM)
+    device->pxl_raw = malloc(frame_bytes(ws2811));
+    if (device->pxl_raw == NULL)
+    {
+        ws2811_cleanup(ws2811);
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+    pcm_raw_init(ws2811);
+
+    if (encode_workers_start(ws2811))
+    {
+        ws2811_cleanup(ws2811);
+        return WS2811_ERROR_THREAD;
+    }
+
+    if (frame_buffers_alloc(ws2811))
+    {
+        ws2811_cleanup(ws2811);
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+
+    rt_setup(ws2811);
+
+    return WS2811_SUCCESS;
+}
+
+static ws2811_return_t spi_transfer(ws2811_t *ws2811)
+{
+    int ret;
+    struct spi_ioc_transfer tr;
+
+    memset(&tr, 0, sizeof(struct spi_ioc_transfer));
+    tr.tx_buf = (unsigned long)ws2811->device->pxl_raw;
+    tr.rx_buf = 0;
+    tr.len = frame_bytes(ws2811);
+
+    ret = ioctl(ws2811->device->spi_fd, SPI_IOC_MESSAGE(1), &tr);
+    if (ret < 1)
+    {
+        fprintf(stderr, "Can't send spi message");
+        return WS2811_ERROR_SPI_TRANSFER;
+    }
+
+    return WS2811_SUCCESS;
+}
+
+
+/**
+ * Retire the queued frames the DMA has finished with.  The frame the DMA is
+ * currently working on, data or gap, becomes the head of the queue.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void queue_reclaim(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    volatile dma_t *dma = device->dma;
+    uint32_t cb_addr = dma_current_cb(device);
+    int frame;
+
+    if (!(dma->cs & RPI_DMA_CS_ACTIVE) || !cb_addr)
+    {
+        device->queue_len = 0;
+        return;
+    }
+
+    frame = (cb_addr - device->frames[0].dma_cb_addr) / (device->frame_cbs * sizeof(dma_cb_t));
+    device->queue_len -= (frame - device->queue_head + device->frame_count) % device->frame_count;
+    device->queue_head = frame;
+}
+
+/**
+ * Change what follows the current tail of the queue, the next frame, the tail
+ * itself when looping or 0 to end.  A refresh looping tail is left right after
+ * its reset, or at the end of its gap if the DMA is already past the reset.
+ * If the DMA has already loaded one of those control blocks it also holds a
+ * copy of the old nextconbk.  In that case the DMA is paused, as it's only
+ * sending the gap, and the register is patched directly.
+ *
+ * @param    ws2811     ws2811 instance pointer.
+ * @param    tail       Frame currently at the end of the queue.
+ * @param    next_addr  Bus address of the control block to continue with.
+ *
+ * @returns  1 if the DMA is still running, 0 if it already stopped.
+ */
+static int queue_link(ws2811_t *ws2811, ws2811_frame_t *tail, uint32_t next_addr)
+{
+    ws2811_device_t *device = ws2811->device;
+    volatile dma_t *dma = device->dma;
+    uint32_t last_addr = tail->dma_cb_addr + (device->frame_cbs - 1) * sizeof(dma_cb_t);
+    uint32_t reset_addr = tail->reset_cb ? addr_to_bus(device, tail->reset_cb) : last_addr;
+    uint32_t cs = dma_run_cs(device);
+    uint32_t cur;
+
+    if (tail->reset_cb)
+    {
+        dma_cb_set_next(device, tail->reset_cb, next_addr);
+    }
+    dma_cb_set_next(device, tail->last_cb, next_addr);
+    __sync_synchronize();
+
+    cur = dma_current_cb(device);
+    if (((cur == last_addr) || (cur == reset_addr)) && (dma_next_cb(device) != next_addr))
+    {
+        dma->cs = cs;    // Pause
+        while ((dma_current_cb(device) == cur) && !(dma->cs & RPI_DMA_CS_PAUSED))
+            ;
+
+        if (dma_current_cb(device) != cur)
+        {
+            // Paused on whatever followed, dma_start() must reset the channel
+            device->dma_ready = 0;
+            return 0;
+        }
+
+        dma_set_next_cb(device, next_addr);
+        dma->cs = cs | RPI_DMA_CS_ACTIVE;
+    }
+
+    return (dma->cs & RPI_DMA_CS_ACTIVE) ? 1 : 0;
+}
+
+/**
+ * Time a queued frame takes before the next one starts, its data and gap, or
+ * only up to the reset when a refresh loop is left early.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  Time in microseconds.
+ */
+static uint64_t queue_interval(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+
+    return dma_transfer_time(ws2811, device->dma_bytes +
+                             (device->reset_bytes ? device->reset_bytes : device->gap_bytes),
+                             device->clk_freq);
+}
+
+/**
+ * Get the time the frame at the head of the queue is done with, data and gap.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    due     Returns the CLOCK_MONOTONIC time.
+ *
+ * @returns  None
+ */
+static void queue_head_due(ws2811_t *ws2811, struct timespec *due)
+{
+    ws2811_device_t *device = ws2811->device;
+    uint64_t interval = queue_interval(ws2811);
+    uint64_t ahead = interval * (device->queue_len > 0 ? device->queue_len - 1 : 0);
+    uint64_t ns = (uint64_t)device->dma_due.tv_sec * 1000000000 + device->dma_due.tv_nsec;
+
+    ns = ns > ahead * 1000 ? ns - ahead * 1000 : 0;
+    due->tv_sec = ns / 1000000000;
+    due->tv_nsec = ns % 1000000000;
+}
+
+/**
+ * Release what ws2811_init() has set up when it fails before the LED buffers
+ * are allocated, so the DMA channel lock isn't held by a failed instance.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    ret     Error to return.
+ *
+ * @returns  ret
+ */
+static ws2811_return_t init_abort(ws2811_t *ws2811, ws2811_return_t ret)
+{
+    ws2811_device_t *device = ws2811->device;
+
+    if (device->stage)
+    {
+        free(device->stage);
+    }
+
+    if (device->frames)
+    {
+        free(device->frames);
+    }
+
+    if (device->mbox.handle != -1)
+    {
+        dma_mem_free(device);
+        mbox_close(device->mbox.handle);
+    }
+
+    if (device->spi_fd > 0)
+    {
+        close(device->spi_fd);
+    }
+
+    if (device->timer_fd >= 0)
+    {
+        close(device->timer_fd);
+    }
+
+    if (device->dma_lock_fd >= 0)
+    {
+        close(device->dma_lock_fd);
+    }
+
+    free(device);
+    ws2811->device = NULL;
+
+    return ret;
+}
+
+
+/*
+ *
+ * Application API Functions
+ *
+ */
+
+
+/**
+ * Allocate and initialize memory, buffers, pages, PWM, DMA, and GPIO.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, -1 otherwise.
+ */
+ws2811_return_t ws2811_init(ws2811_t *ws2811)
+{
+    ws2811_device_t *device;
+    ws2811_return_t ret;
+    int chan;
+
+    ws2811->rpi_hw = rpi_hw_detect();
+    if (!ws2811->rpi_hw)
+    {
+        return WS2811_ERROR_HW_NOT_SUPPORTED;
+    }
+
+    ws2811->device = malloc(sizeof(*ws2811->device));
+    if (!ws2811->device)
+    {
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+    memset(ws2811->device, 0, sizeof(*ws2811->device));
+    device = ws2811->device;
+    device->dma_lock_fd = -1;
+    device->mbox.handle = -1;
+
+    // Completion timer for ws2811_get_fd(), initially readable as nothing is pending
+    device->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (device->timer_fd < 0)
+    {
+        return init_abort(ws2811, WS2811_ERROR_GENERIC);
+    }
+    timerfd_settime(device->timer_fd, 0, &(struct itimerspec){ .it_value.tv_nsec = 1 }, NULL);
+
+    if (check_hwver_and_gpionum(ws2811) < 0)
+    {
+        return init_abort(ws2811, WS2811_ERROR_ILLEGAL_GPIO);
+    }
+
+    device->max_count = max_channel_led_count(ws2811);
+
+    // The PWM FIFO only interleaves words when both channels are in use
+    device->fifo_chans = 1;
+    if (device->driver_mode == PWM)
+    {
+        if (ws2811->channel[0].count && ws2811->channel[1].count)
+        {
+            device->fifo_chans = RPI_PWM_CHANNELS;
+        }
+        else if (ws2811->channel[1].count)
+        {
+            device->chan_first = 1;
+        }
+    }
+
+    if (timing_setup(ws2811))
+    {
+        return init_abort(ws2811, WS2811_ERROR_NOT_SUPPORTED);
+    }
+
+    if (device->driver_mode == SPI) {
+        ws2811->freq_actual = ws2811->freq;
+        ret = spi_init(ws2811);
+
+        // Later failures have already cleaned up through ws2811_cleanup()
+        if ((ret != WS2811_SUCCESS) && ws2811->device)
+        {
+            return init_abort(ws2811, ret);
+        }
+
+        return ret;
+    }
+
+    // Pick the clock source and divider closest to the profile's symbols per bit at the requested rate
+    if (clk_plan(clk_osc_freq(ws2811), clk_plld_freq(ws2811), ws2811->freq * device->timing->symbols,
+                 &device->clk))
+    {
+        return init_abort(ws2811, WS2811_ERROR_ILLEGAL_FREQ);
+    }
+    ws2811->freq_actual = device->clk.freq / device->timing->symbols;
+
+    // Pick a free DMA channel if asked to, otherwise make sure nobody else uses ours
+    if (ws2811->dmanum < 0)
+    {
+        ws2811->dmanum = dma_select(ws2811);
+        if (ws2811->dmanum < 0)
+        {
+            return init_abort(ws2811, WS2811_ERROR_DMA_IN_USE);
+        }
+    }
+    else if (dma_reserve(ws2811, ws2811->dmanum))
+    {
+        return init_abort(ws2811, WS2811_ERROR_DMA_IN_USE);
+    }
+
+    // Lite channels only move 64K per control block, longer transfers get chained
+    device->dma4 = dma_is_dma4(ws2811, ws2811->dmanum);
+    device->txfr_max = dma_probe_txfr_max(ws2811, ws2811->dmanum);
+
+    ret = frame_layout(ws2811);
+    if (ret != WS2811_SUCCESS)
+    {
+        return init_abort(ws2811, ret);
+    }
+
+    device->frames = malloc(sizeof(*device->frames) * device->frame_count);
+    if (!device->frames)
+    {
+        return init_abort(ws2811, WS2811_ERROR_OUT_OF_MEMORY);
+    }
+
+    // Frames are encoded in cached memory, the DMA memory is only written by block copies
+    device->stage = calloc(1, device->frame_size);
+    if (!device->stage)
+    {
+        return init_abort(ws2811, WS2811_ERROR_OUT_OF_MEMORY);
+    }
+
+    device->mbox.size = dma_mem_size(device);
+
+    device->mbox.handle = mbox_open();
+    if (device->mbox.handle == -1)
+    {
+        return init_abort(ws2811, WS2811_ERROR_MAILBOX_DEVICE);
+    }
+
+    ret = dma_mem_alloc(ws2811);
+    if (ret != WS2811_SUCCESS)
+    {
+        return init_abort(ws2811, ret);
+    }
+
+    // Initialize all pointers to NULL.  Any non-NULL pointers will be freed on cleanup.
+    device->pxl_raw = NULL;
+    device->dma_cb = NULL;
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        ws2811->channel[chan].leds = NULL;
+    }
+
+    // Allocate the LED buffers
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        ws2811_channel_t *channel = &ws2811->channel[chan];
+
+        channel->leds = malloc(sizeof(ws2811_led_t) * channel->count);
+        if (!channel->leds)
+        {
+            ws2811_cleanup(ws2811);
+            return WS2811_ERROR_OUT_OF_MEMORY;
+        }
+
+        memset(channel->leds, 0, sizeof(ws2811_led_t) * channel->count);
+        device->leds_owned[chan] = 1;
+        device->leds_count[chan] = channel->count;
+
+        if (!channel->strip_type)
+        {
+          channel->strip_type=WS2811_STRIP_RGB;
+        }
+
+        // Set default uncorrected gamma table
+        if (!channel->gamma)
+        {
+          channel->gamma = malloc(sizeof(uint8_t) * 256);
+          int x;
+          for(x = 0; x < 256; x++){
+            channel->gamma[x] = x;
+          }
+        }
+
+        channel->wshift = (channel->strip_type >> 24) & 0xff;
+        channel->rshift = (channel->strip_type >> 16) & 0xff;
+        channel->gshift = (channel->strip_type >> 8)  & 0xff;
+        channel->bshift = (channel->strip_type >> 0)  & 0xff;
+
+    }
+
+    // Clear the control blocks and frames, inverted operation will be handled by hardware
+    dma_raw_init(ws2811);
+
+    frames_place(ws2811);
+
+    // Map the physical registers into userspace
+    if (map_registers(ws2811))
+    {
+        ws2811_cleanup(ws2811);
+        return WS2811_ERROR_MAP_REGISTERS;
+    }
+
+    // Initialize the GPIO pins
+    if (gpio_init(ws2811))
+    {
+        unmap_registers(ws2811);
+        ws2811_cleanup(ws2811);
+        return WS2811_ERROR_GPIO_INIT;
+    }
+
+    switch (device->driver_mode) {
+    case PWM:
+        // Setup the PWM, clocks, and DMA
+        if (setup_pwm(ws2811))
+        {
+            unmap_registers(ws2811);
+            ws2811_cleanup(ws2811);
+            return WS2811_ERROR_PWM_SETUP;
+        }
+        break;
+    case PCM:
+    // Setup the PCM, clock, and DMA
+        if (setup_pcm(ws2811))
+        {
+            unmap_registers(ws2811);
+            ws2811_cleanup(ws2811);
+            return WS2811_ERROR_PCM_SETUP;
+        }
+        break;
+    }
+
+    if (encode_workers_start(ws2811))
+    {
+        unmap_registers(ws2811);
+        ws2811_cleanup(ws2811);
+        return WS2811_ERROR_THREAD;
+    }
+
+    if (frame_buffers_alloc(ws2811))
+    {
+        unmap_registers(ws2811);
+        ws2811_cleanup(ws2811);
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+
+    rt_setup(ws2811);
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Shut down DMA, PWM, and cleanup memory.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+void ws2811_fini(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    volatile pcm_t *pcm = device->pcm;
+
+    render_thread_stop(ws2811);
+    ws2811_wait(ws2811);
+    if (device->frame_loop)
+    {
+        // Let the looping frame finish its gap and stop
+        queue_link(ws2811, &device->frames[device->queue_head], 0);
+        device->frame_loop = 0;
+        ws2811_wait(ws2811);
+    }
+
+    switch (ws2811->device->driver_mode) {
+    case PWM:
+        stop_pwm(ws2811);
+        break;
+    case PCM:
+        while (!(pcm->cs & RPI_PCM_CS_TXE)) ;    // Wait till TX FIFO is empty
+        stop_pcm(ws2811);
+        break;
+    }
+
+    unmap_registers(ws2811);
+
+    ws2811_cleanup(ws2811);
+}
+
+/**
+ * Wait for any executing DMA operation to complete before returning.  Unless
+ * poll_wait is set, sleep until shortly before the transfer is due to finish
+ * and only poll the DMA status for the last few microseconds.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, -1 on DMA competion error
+ */
+ws2811_return_t ws2811_wait(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    volatile dma_t *dma = device->dma;
+
+    if (device->driver_mode == SPI)  // Nothing to do for SPI
+    {
+        return WS2811_SUCCESS;
+    }
+
+    if (!ws2811->poll_wait && (dma->cs & RPI_DMA_CS_ACTIVE))
+    {
+        struct timespec wakeup = device->dma_due;
+
+        // Subtract the margin so we are already polling when the DMA completes
+        wakeup.tv_nsec -= DMA_WAIT_MARGIN_uS * 1000;
+        if (wakeup.tv_nsec < 0)
+        {
+            wakeup.tv_sec--;
+            wakeup.tv_nsec += 1000000000;
+        }
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup, NULL) == EINTR)
+            ;
+    }
+
+    if (device->frame_loop)
+    {
+        // The DMA never stops, wait for it to reach the last frame instead
+        queue_reclaim(ws2811);
+        while ((device->queue_len > 1) && !dma_error(device))
+        {
+            usleep(10);
+            queue_reclaim(ws2811);
+        }
+    }
+
+    while (!device->frame_loop &&
+           (dma->cs & RPI_DMA_CS_ACTIVE) &&
+           !dma_error(device))
+    {
+        usleep(10);
+    }
+
+    if (dma_error(device))
+    {
+        fprintf(stderr, "DMA Error: %08x\n", dma_debug(device));
+        return WS2811_ERROR_DMA;
+    }
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Apply changed LED counts, strip types, inversion, timing profile or bit rate
+ * without ws2811_fini() and ws2811_init().  The DMA memory, registers and
+ * DMA channel are kept, and the memory is only reallocated if the new frames
+ * don't fit.  The clock is only reprogrammed if its divider changes.  Library
+ * allocated LED arrays keep their contents, attached ones must already hold
+ * the new count.  Changing which channels are in use, the GPIOs or the DMA
+ * channel still needs ws2811_init().
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, < 0 on failure.  An unsupported profile, bit rate or
+ *           combination of options is refused before anything is changed.  After
+ *           a failed reallocation or SPI setup only ws2811_fini() is allowed.
+ */
+ws2811_return_t ws2811_reconfigure(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    const ws2811_timing_t *timing = timing_profile(ws2811);
+    clk_plan_t clk = device->clk;
+    clk_plan_t plan = device->clk;
+    ws2811_frame_t *frames;
+    ws2811_return_t ret;
+    uint32_t mbox_size;
+    int chan;
+
+    // Refuse what timing_setup(), clk_plan() and frame_layout() would before changing anything
+    if (!timing)
+    {
+        return WS2811_ERROR_NOT_SUPPORTED;
+    }
+
+    if (device->driver_mode != SPI)
+    {
+        uint32_t freq = timing_freq(ws2811, timing);
+
+        if (clk_plan(clk_osc_freq(ws2811), clk_plld_freq(ws2811), freq * timing->symbols, &plan))
+        {
+            return WS2811_ERROR_ILLEGAL_FREQ;
+        }
+
+        if ((ws2811->stream_leds > 0) && queue_mode(ws2811))
+        {
+            return WS2811_ERROR_NOT_SUPPORTED;
+        }
+    }
+
+    // The same channels must still be fed from the FIFO
+    if (device->driver_mode == PWM)
+    {
+        int both = ws2811->channel[0].count && ws2811->channel[1].count;
+
+        if ((device->fifo_chans != (both ? RPI_PWM_CHANNELS : 1)) ||
+            (!both && (device->chan_first != (ws2811->channel[1].count ? 1 : 0))))
+        {
+            return WS2811_ERROR_NOT_SUPPORTED;
+        }
+    }
+
+    // The render thread starts again with the next published frame
+    render_thread_stop(ws2811);
+
+    // Let the frame on the wire finish, and a looping one stop
+    if ((ret = ws2811_wait(ws2811)) != WS2811_SUCCESS)
+    {
+        return ret;
+    }
+    if (device->frame_loop)
+    {
+        queue_link(ws2811, &device->frames[device->queue_head], 0);
+        device->frame_loop = 0;
+        if ((ret = ws2811_wait(ws2811)) != WS2811_SUCCESS)
+        {
+            return ret;
+        }
+    }
+    device->queue_head = 0;
+    device->queue_len = 0;
+
+    if (timing_setup(ws2811))
+    {
+        return WS2811_ERROR_NOT_SUPPORTED;
+    }
+    device->max_count = max_channel_led_count(ws2811);
 
     for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
     {
-        int pinnum = ws2811->channel[chan].gpionum;
+        ws2811_channel_t *channel = &ws2811->channel[chan];
 
-        if (pinnum)
+        if (device->leds_owned[chan])
         {
-            switch (ws2811->device->driver_mode)
+            ws2811_led_t *leds = realloc(channel->leds, sizeof(ws2811_led_t) * (channel->count + 1));
+
+            if (!leds)
             {
-            case PWM:
-                altnum = pwm_pin_alt(chan, pinnum);
-                break;
-            case PCM:
-                altnum = pcm_pin_alt(PCMFUN_DOUT, pinnum);
-                break;
-            default:
-                altnum = -1;
+                return WS2811_ERROR_OUT_OF_MEMORY;
             }
+            channel->leds = leds;
 
-            if (altnum < 0)
+            // LEDs added at the end start off
+            if (channel->count > device->leds_count[chan])
             {
-                return -1;
+                memset(&leds[device->leds_count[chan]], 0,
+                       sizeof(ws2811_led_t) * (channel->count - device->leds_count[chan]));
             }
+        }
+        device->leds_count[chan] = channel->count;
 
-            gpio_function_set(gpio, pinnum, altnum);
+        if (!channel->strip_type)
+        {
+            channel->strip_type = WS2811_STRIP_RGB;
+        }
+        channel->wshift = (channel->strip_type >> 24) & 0xff;
+        channel->rshift = (channel->strip_type >> 16) & 0xff;
+        channel->gshift = (channel->strip_type >> 8)  & 0xff;
+        channel->bshift = (channel->strip_type >> 0)  & 0xff;
+
+        if (device->frame_leds[chan])
+        {
+            free(device->frame_leds[chan]);
+            device->frame_leds[chan] = NULL;
+            device->render_leds[chan] = NULL;
         }
     }
 
-    return 0;
+    if (frame_buffers_alloc(ws2811))
+    {
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+
+    if (device->driver_mode == SPI)
+    {
+        uint32_t speed = ws2811->freq * device->timing->symbols;
+        uint8_t *pxl_raw = realloc((uint8_t *)device->pxl_raw, frame_bytes(ws2811));
+
+        if (!pxl_raw)
+        {
+            return WS2811_ERROR_OUT_OF_MEMORY;
+        }
+        device->pxl_raw = pxl_raw;
+        pcm_raw_init(ws2811);
+
+        if (ioctl(device->spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0)
+        {
+            return WS2811_ERROR_SPI_SETUP;
+        }
+        ws2811->freq_actual = ws2811->freq;
+
+        return WS2811_SUCCESS;
+    }
+
+    device->clk = plan;
+    ws2811->freq_actual = device->clk.freq / device->timing->symbols;
+
+    ret = frame_layout(ws2811);
+    if (ret != WS2811_SUCCESS)
+    {
+        return ret;
+    }
+
+    frames = realloc(device->frames, sizeof(*device->frames) * device->frame_count);
+    if (!frames)
+    {
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+    device->frames = frames;
+
+    // Grow the DMA memory only when the new frames don't fit
+    mbox_size = dma_mem_size(device);
+    if (mbox_size > device->mbox.size)
+    {
+        dma_mem_free(device);
+        device->mbox.size = mbox_size;
+        ret = dma_mem_alloc(ws2811);
+        if (ret != WS2811_SUCCESS)
+        {
+            return ret;
+        }
+    }
+
+    free(device->stage);
+    device->stage = calloc(1, device->frame_size);
+    if (!device->stage)
+    {
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+
+    dma_raw_init(ws2811);
+    frames_place(ws2811);
+
+    // Retune the clock only if the divider changed, otherwise just rebuild the control blocks
+    if (memcmp(&clk, &device->clk, sizeof(clk)))
+    {
+        if (((device->driver_mode == PWM) && setup_pwm(ws2811)) ||
+            ((device->driver_mode == PCM) && setup_pcm(ws2811)))
+        {
+            return WS2811_ERROR_GENERIC;
+        }
+    }
+    else
+    {
+        setup_frames(ws2811);
+        if (device->driver_mode == PWM)
+        {
+            volatile pwm_t *pwm = device->pwm;
+            uint32_t ctl = pwm->ctl & ~(RPI_PWM_CTL_POLA1 | RPI_PWM_CTL_POLA2);
+
+            pwm->ctl = ctl | (ws2811->channel[0].invert ? RPI_PWM_CTL_POLA1 : 0) |
+                             (ws2811->channel[1].invert ? RPI_PWM_CTL_POLA2 : 0);
+        }
+    }
+
+    if (ws2811->rt_lock)
+    {
+        ws2811->rt_status |= rt_memory_setup(ws2811);
+    }
+
+    return WS2811_SUCCESS;
 }
 
 /**
- * Initialize the PWM DMA buffer with all zeros, inverted operation will be
- * handled by hardware.  The DMA buffer length is assumed to be a word
- * multiple.
+ * Calculate how long the LED data takes on the wire.
  *
  * @param    ws2811  ws2811 instance pointer.
  *
- * @returns  None
+ * @returns  Time in microseconds the longest channel takes on the wire.
  */
-void pwm_raw_init(ws2811_t *ws2811)
+static uint32_t render_protocol_time(ws2811_t *ws2811)
 {
-    volatile uint32_t *pxl_raw = (uint32_t *)ws2811->device->pxl_raw;
-    int maxcount = ws2811->device->max_count;
-    int wordcount = (PWM_BYTE_COUNT(maxcount, ws2811->freq) / sizeof(uint32_t)) /
-                    RPI_PWM_CHANNELS;
+    uint32_t protocol_time = 0;
     int chan;
 
     for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
     {
-        int i, wordpos = chan;
+        ws2811_channel_t *channel = &ws2811->channel[chan];
+        uint8_t array_size = 3; // Assume 3 color LEDs, RGB
+
+        // If our shift mask includes the highest nibble, then we have 4 LEDs, RBGW.
+        if (channel->strip_type & SK6812_SHIFT_WMASK)
+        {
+            array_size = 4;
+        }
+
+        // 1.25µs per bit at 800kHz
+        const uint32_t channel_protocol_time = (uint64_t)channel->count * array_size * 8 * 1000000 / ws2811->freq;
 
-        for (i = 0; i < wordcount; i++)
+        // Only using the channel which takes the longest as both run in parallel
+        if (channel_protocol_time > protocol_time)
         {
-            pxl_raw[wordpos] = 0x0;
-            wordpos += 2;
+            protocol_time = channel_protocol_time;
         }
     }
+
+    return protocol_time;
 }
 
 /**
- * Initialize the PCM DMA buffer with all zeros.
- * The DMA buffer length is assumed to be a word multiple.
+ * Check whether the previous frame is still being sent or latched.
  *
  * @param    ws2811  ws2811 instance pointer.
  *
- * @returns  None
+ * @returns  1 if a new frame can't be started yet, 0 otherwise.
  */
-void pcm_raw_init(ws2811_t *ws2811)
+static int render_pending(ws2811_t *ws2811)
 {
-    volatile uint32_t *pxl_raw = (uint32_t *)ws2811->device->pxl_raw;
-    int maxcount = ws2811->device->max_count;
-    int wordcount = PCM_BYTE_COUNT(maxcount, ws2811->freq) / sizeof(uint32_t);
-    int i;
+    ws2811_device_t *device = ws2811->device;
 
-    for (i = 0; i < wordcount; i++)
+    if ((device->driver_mode != SPI) && (device->dma->cs & RPI_DMA_CS_ACTIVE))
     {
-        pxl_raw[i] = 0x0;
+        return 1;
+    }
+
+    if (ws2811->render_wait_time != 0)
+    {
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec < device->render_due.tv_sec) ||
+            ((now.tv_sec == device->render_due.tv_sec) && (now.tv_nsec < device->render_due.tv_nsec)))
+        {
+            return 1;
+        }
     }
+
+    return 0;
 }
 
 /**
- * Cleanup previously allocated device memory and buffers.
+ * Sleep until the previous frame has had enough time to latch.
  *
  * @param    ws2811  ws2811 instance pointer.
  *
  * @returns  None
  */
-void ws2811_cleanup(ws2811_t *ws2811)
+static void render_pace(ws2811_t *ws2811)
+{
+    if (ws2811->render_wait_time != 0) {
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ws2811->device->render_due, NULL) == EINTR)
+            ;
+    }
+}
+
+/**
+ * Record that a frame has just been started and arm the completion timer.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void render_started(ws2811_t *ws2811)
 {
     ws2811_device_t *device = ws2811->device;
-    int chan;
+    struct itimerspec done = { 0 };
 
-    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    // LED_RESET_WAIT_TIME is added to allow enough time for the reset to occur.
+    device->render_timestamp = get_microsecond_timestamp();
+    ws2811->render_wait_time = render_protocol_time(ws2811) + LED_RESET_WAIT_TIME;
+    clock_gettime(CLOCK_MONOTONIC, &device->render_due);
+    timespec_add_us(&device->render_due, ws2811->render_wait_time);
+
+    // The DMA buffer holds 4 colours per LED and the reset, it can outlast the latch time
+    if ((device->driver_mode != SPI) &&
+        ((device->dma_due.tv_sec > device->render_due.tv_sec) ||
+         ((device->dma_due.tv_sec == device->render_due.tv_sec) &&
+          (device->dma_due.tv_nsec > device->render_due.tv_nsec))))
     {
-        if (ws2811->channel[chan].leds)
-        {
-            free(ws2811->channel[chan].leds);
-        }
-        ws2811->channel[chan].leds = NULL;
-        if (ws2811->channel[chan].gamma)
-        {
-            free(ws2811->channel[chan].gamma);
-        }
-        ws2811->channel[chan].gamma = NULL;
+        device->render_due = device->dma_due;
     }
 
-    if (device->mbox.handle != -1)
+    // The completion descriptor becomes readable once the frame has latched
+    done.it_value = device->render_due;
+    timerfd_settime(device->timer_fd, TFD_TIMER_ABSTIME, &done, NULL);
+}
+
+/**
+ * Send the already rendered buffer to the hardware.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, < 0 on failure.
+ */
+static ws2811_return_t render_start(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    ws2811_return_t ret = WS2811_SUCCESS;
+
+    if (device->driver_mode != SPI)
     {
-        videocore_mbox_t *mbox = &device->mbox;
+        dma_start(ws2811, device->dma_cb_addr);
+    }
+    else
+    {
+        device->start_ns = get_nanosecond_timestamp();
+        ret = spi_transfer(ws2811);
+    }
+
+    render_started(ws2811);
+
+    return ret;
+}
 
-        unmapmem(mbox->virt_addr, mbox->size);
-        mem_unlock(mbox->handle, mbox->mem_ref);
-        mem_free(mbox->handle, mbox->mem_ref);
-        mbox_close(mbox->handle);
+/**
+ * Add the second plain mode frame buffer the two-phase API encodes into,
+ * growing the DMA memory if the page slack doesn't already hold it.  Plain
+ * ws2811_render() users never pay for it.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, < 0 on failure with the single frame still in place.
+ */
+static ws2811_return_t frame_pair_setup(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    videocore_mbox_t mbox = device->mbox;
+    videocore_mbox_t fresh;
+    ws2811_frame_t *frames;
+    ws2811_return_t ret;
 
-        mbox->handle = -1;
+    if ((device->driver_mode == SPI) || device->frame_pair)
+    {
+        return WS2811_SUCCESS;
     }
 
-    if (device && (device->spi_fd > 0))
+    // The DMA may still be reading the only frame
+    if ((ret = ws2811_wait(ws2811)) != WS2811_SUCCESS)
     {
-        close(device->spi_fd);
+        return ret;
     }
 
-    if (device) {
-        free(device);
+    frames = realloc(device->frames, sizeof(*device->frames) * 2);
+    if (!frames)
+    {
+        return WS2811_ERROR_OUT_OF_MEMORY;
     }
-    ws2811->device = NULL;
-}
+    device->frames = frames;
 
-static int set_driver_mode(ws2811_t *ws2811, int gpionum)
-{
-    int gpionum2;
+    device->frame_pair = 1;
+    frame_layout(ws2811);
 
-    if (gpionum == 18 || gpionum == 12) {
-        ws2811->device->driver_mode = PWM;
-        // Check gpio for PWM1 (2nd channel) is OK if used
-        gpionum2 = ws2811->channel[1].gpionum;
-        if (gpionum2 == 0 || gpionum2 == 13 || gpionum2 == 19) {
-            return 0;
+    if (dma_mem_size(device) > mbox.size)
+    {
+        device->mbox.size = dma_mem_size(device);
+        ret = dma_mem_alloc(ws2811);
+        if (ret != WS2811_SUCCESS)
+        {
+            device->mbox = mbox;
+            device->frame_pair = 0;
+            frame_layout(ws2811);
+            return ret;
         }
+
+        // Release the old memory only once the new one is in place
+        fresh = device->mbox;
+        device->mbox = mbox;
+        dma_mem_free(device);
+        device->mbox = fresh;
     }
-    else if (gpionum == 21 || gpionum == 31) {
-        ws2811->device->driver_mode = PCM;
+
+    dma_raw_init(ws2811);
+    frames_place(ws2811);
+    setup_frames(ws2811);
+
+    if (ws2811->rt_lock)
+    {
+        ws2811->rt_status |= rt_memory_setup(ws2811);
     }
-    else if (gpionum == 10) {
-        ws2811->device->driver_mode = SPI;
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Encode the LED arrays into the frame buffer the DMA isn't sending, so
+ * encoding never waits on the previous frame.  With a single frame buffer
+ * that is the one just sent, as ws2811_render() always did.  SPI has a single
+ * buffer, its transfers are synchronous.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void frame_prepare(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+
+    if (device->driver_mode == SPI)
+    {
+        render_encode(ws2811, device->pxl_raw);
     }
-    else {
-        fprintf(stderr, "gpionum %d not allowed\n", gpionum);
-        return -1;
+    else
+    {
+        render_encode(ws2811, device->frames[(device->frame_cur + 1) % device->frame_count].pxl_raw);
     }
-    // For PCM and SPI zero the 2nd channel
-    memset(&ws2811->channel[1], 0, sizeof(ws2811_channel_t));
 
-    return 0;
+    device->frame_prepared = 1;
 }
 
-static int check_hwver_and_gpionum(ws2811_t *ws2811)
+/**
+ * Start sending the prepared frame, the hardware must be idle.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, < 0 on failure.
+ */
+static ws2811_return_t frame_commit(ws2811_t *ws2811)
 {
-    const rpi_hw_t *rpi_hw;
-    int hwver, gpionum;
-    int gpionums_B1[] = { 10, 18, 21 };
-    int gpionums_B2[] = { 10, 18, 31 };
-    int gpionums_40p[] = { 10, 12, 18, 21};
-    int i;
+    ws2811_device_t *device = ws2811->device;
 
-    rpi_hw = ws2811->rpi_hw;
-    hwver = rpi_hw->hwver & 0x0000ffff;
-    gpionum = ws2811->channel[0].gpionum;
-    if (hwver < 0x0004)  // Model B Rev 1
+    if (device->driver_mode != SPI)
+    {
+        ws2811_frame_t *frame;
+
+        device->frame_cur = (device->frame_cur + 1) % device->frame_count;
+        frame = &device->frames[device->frame_cur];
+        device->dma_cb = frame->dma_cb;
+        device->dma_cb_addr = frame->dma_cb_addr;
+        device->pxl_raw = frame->pxl_raw;
+    }
+    device->frame_prepared = 0;
+
+    return render_start(ws2811);
+}
+
+/**
+ * Render and send a frame through the ring of stream segments.  The first
+ * segments are encoded before the DMA starts, each following one is encoded
+ * into the segment the DMA has just finished and linked behind the one
+ * currently being sent.  Blocks until the last segment has been queued.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, WS2811_ERROR_UNDERRUN if the DMA ran out of segments.
+ */
+static ws2811_return_t stream_render(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    volatile dma_t *dma = device->dma;
+    int chans = device->fifo_chans;
+    int words = device->dma_bytes / sizeof(uint32_t) / chans;
+    int segments = (words + device->stream_words - 1) / device->stream_words;
+    uint64_t segment_time = dma_transfer_time(ws2811, device->stream_words * sizeof(uint32_t) * chans,
+                                              device->clk_freq);
+    ws2811_encoder_t enc[RPI_PWM_CHANNELS];
+    struct timespec start = { 0 };
+    int seg, chan;
+
+    encode_leds_select(ws2811);
+    for (chan = 0; chan < chans; chan++)
     {
-        for ( i = 0; i < (int)(sizeof(gpionums_B1) / sizeof(gpionums_B1[0])); i++)
-        {
-            if (gpionums_B1[i] == gpionum) {
-                // Set driver mode (PWM, PCM, or SPI)
-                return set_driver_mode(ws2811, gpionum);
-            }
-        }
+        encoder_init(ws2811, &enc[chan], &ws2811->channel[device->chan_first + chan]);
     }
-    else if (hwver >= 0x0004 && hwver <= 0x000f)  // Models B Rev2, A
+
+    for (seg = 0; seg < segments; seg++)
     {
-        for ( i = 0; i < (int)(sizeof(gpionums_B2) / sizeof(gpionums_B2[0])); i++)
+        ws2811_frame_t *frame = &device->frames[seg % device->frame_count];
+        ws2811_frame_t *prev = &device->frames[(seg + device->frame_count - 1) % device->frame_count];
+        int count = words - (seg * device->stream_words);
+
+        if (count > device->stream_words)
         {
-            if (gpionums_B2[i] == gpionum) {
-                // Set driver mode (PWM, PCM, or SPI)
-                return set_driver_mode(ws2811, gpionum);
-            }
+            count = device->stream_words;
         }
-    }
-    else if (hwver >= 0x010) // Models B+, A+, 2B, 3B, Zero Zero-W
-    {
-        if ((ws2811->channel[0].count == 0) && (ws2811->channel[1].count > 0))
+
+        // Encode ahead in cached memory while the DMA may still need the segment buffer
+        if (chans == 1)
         {
-            // Special case: nothing in channel 0, channel 1 only PWM1 allowed
-            // PWM1 only available on 40 pin GPIO interface
-            gpionum = ws2811->channel[1].gpionum;
-            if ((gpionum == 13) || (gpionum == 19))
+            encoder_words(&enc[0], (volatile uint32_t *)device->stage, 1, count);
+        }
+        else
+        {
+            encoder_pairs(enc, (volatile uint64_t *)device->stage, count);
+        }
+
+        if (seg >= device->frame_count)
+        {
+            // Wait for the DMA to finish the segment sent frame_count segments ago
+            if (!ws2811->poll_wait)
             {
-                ws2811->device->driver_mode = PWM;
-                return 0;
+                struct timespec wakeup = start;
+
+                timespec_add_us(&wakeup, (seg - device->frame_count + 1) * segment_time);
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup, NULL);
             }
-            else {
-                return -1;
+
+            while ((dma_current_cb(device) == frame->dma_cb_addr) && (dma->cs & RPI_DMA_CS_ACTIVE))
+            {
+                usleep(10);
             }
         }
-        for ( i = 0; i < (int)(sizeof(gpionums_40p) / sizeof(gpionums_40p[0])); i++)
+
+        stage_copy(frame->pxl_raw, device->stage, count * sizeof(uint32_t) * chans);
+        dma_cb_set_len(device, frame->dma_cb, count * sizeof(uint32_t) * chans);
+        dma_cb_set_next(device, frame->dma_cb, 0);
+
+        if ((seg > 0) && (seg < device->frame_count))
         {
-            if (gpionums_40p[i] == gpionum) {
-                // Set driver mode (PWM, PCM, or SPI)
-                return set_driver_mode(ws2811, gpionum);
-            }
+            dma_cb_set_next(device, prev->dma_cb, frame->dma_cb_addr);
+        }
+        else if ((seg > 0) && !queue_link(ws2811, prev, frame->dma_cb_addr))
+        {
+            fprintf(stderr, "Stream underrun at segment %d of %d\n", seg, segments);
+            return WS2811_ERROR_UNDERRUN;
+        }
+
+        if ((seg == device->frame_count - 1) || (seg == segments - 1 && seg < device->frame_count))
+        {
+            dma_start(ws2811, device->frames[0].dma_cb_addr);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            render_started(ws2811);
         }
     }
-    fprintf(stderr, "Gpio %d is illegal for LED channel 0\n", gpionum);
-    return -1;
+
+    return WS2811_SUCCESS;
 }
 
-static ws2811_return_t spi_init(ws2811_t *ws2811)
+/**
+ * Render the LED arrays into the next free queue entry and append it to the
+ * chain of frames sent by the DMA.  Queued frames follow each other exactly
+ * frame_interval apart without any CPU involvement.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, WS2811_ERROR_BUSY if the queue is full, < 0 on failure.
+ */
+ws2811_return_t ws2811_queue_frame(ws2811_t *ws2811)
 {
-    int spi_fd;
-    static uint8_t mode;
-    static uint8_t bits = 8;
-    uint32_t speed = ws2811->freq * 3;
     ws2811_device_t *device = ws2811->device;
-    uint32_t base = ws2811->rpi_hw->periph_base;
-    int pinnum = ws2811->channel[0].gpionum;
+    struct itimerspec ready = { 0 };
+    ws2811_frame_t *frame;
+    int next;
 
-    spi_fd = open("/dev/spidev0.0", O_RDWR);
-    if (spi_fd < 0) {
-        fprintf(stderr, "Cannot open /dev/spidev0.0. spi_bcm2835 module not loaded?\n");
-        return WS2811_ERROR_SPI_SETUP;
+    if (!queue_mode(ws2811) || (device->driver_mode == SPI))
+    {
+        return WS2811_ERROR_NOT_SUPPORTED;
     }
-    device->spi_fd = spi_fd;
 
-    // SPI mode
-    if (ioctl(spi_fd, SPI_IOC_WR_MODE, &mode) < 0)
+    if (dma_error(device))
     {
-        return WS2811_ERROR_SPI_SETUP;
+        fprintf(stderr, "DMA Error: %08x\n", dma_debug(device));
+        return WS2811_ERROR_DMA;
     }
-    if (ioctl(spi_fd, SPI_IOC_RD_MODE, &mode) < 0)
+
+    queue_reclaim(ws2811);
+    if (device->queue_len == device->frame_count)
     {
-        return WS2811_ERROR_SPI_SETUP;
+        return WS2811_ERROR_BUSY;
     }
 
-    // Bits per word
-    if (ioctl(spi_fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0)
+    next = (device->queue_head + device->queue_len) % device->frame_count;
+    frame = &device->frames[next];
+
+    render_encode(ws2811, frame->pxl_raw);
+    dma_cb_set_next(device, frame->last_cb, device->frame_loop ? frame->dma_cb_addr : 0);
+    if (frame->reset_cb)
     {
-        return WS2811_ERROR_SPI_SETUP;
+        // Undo the early exit this frame was given when it was last replaced
+        dma_cb_set_next(device, frame->reset_cb, addr_to_bus(device, frame->reset_cb + 1));
     }
-    if (ioctl(spi_fd, SPI_IOC_RD_BITS_PER_WORD, &bits) < 0)
+
+    if (device->queue_len &&
+        queue_link(ws2811, &device->frames[(next + device->frame_count - 1) % device->frame_count],
+                   frame->dma_cb_addr))
     {
-        return WS2811_ERROR_SPI_SETUP;
+        if (device->reset_bytes && (device->queue_len == 1))
+        {
+            struct timespec now;
+
+            // The looping tail's due time has long passed, it ends within a pass from now
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ((now.tv_sec > device->dma_due.tv_sec) ||
+                ((now.tv_sec == device->dma_due.tv_sec) && (now.tv_nsec > device->dma_due.tv_nsec)))
+            {
+                device->dma_due = now;
+            }
+        }
+        device->queue_len++;
+        timespec_add_us(&device->dma_due, queue_interval(ws2811));
+    }
+    else
+    {
+        device->queue_head = next;
+        device->queue_len = 1;
+        dma_start(ws2811, frame->dma_cb_addr);
     }
 
-    // Max speed Hz
-    if (ioctl(spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0)
+    // The completion descriptor becomes readable once there is room in the queue
+    if (device->queue_len == device->frame_count)
     {
-        return WS2811_ERROR_SPI_SETUP;
+        queue_head_due(ws2811, &ready.it_value);
     }
-    if (ioctl(spi_fd, SPI_IOC_RD_MAX_SPEED_HZ, &speed) < 0)
+    else
     {
-        return WS2811_ERROR_SPI_SETUP;
+        ready.it_value.tv_nsec = 1;
     }
+    timerfd_settime(device->timer_fd, TFD_TIMER_ABSTIME, &ready, NULL);
 
-    // Initialize device structure elements to not used
-    // except driver_mode, spi_fd and max_count (already defined when spi_init called)
-    device->pxl_raw = NULL;
-    device->dma = NULL;
-    device->pwm = NULL;
-    device->pcm = NULL;
-    device->dma_cb = NULL;
-    device->dma_cb_addr = 0;
-    device->cm_clk = NULL;
-    device->mbox.handle = -1;
+    return WS2811_SUCCESS;
+}
 
-    // Set SPI-MOSI pin
-    device->gpio = mapmem(GPIO_OFFSET + base, sizeof(gpio_t), DEV_GPIOMEM);
-    if (!device->gpio)
+/**
+ * Queue a frame, sleeping until the head of the queue is done if it's full.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, < 0 on failure.
+ */
+static ws2811_return_t queue_frame_wait(ws2811_t *ws2811)
+{
+    ws2811_return_t ret;
+
+    while ((ret = ws2811_queue_frame(ws2811)) == WS2811_ERROR_BUSY)
     {
-        return WS2811_ERROR_SPI_SETUP;
+        struct timespec due;
+
+        queue_head_due(ws2811, &due);
+        if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == 0)
+        {
+            usleep(10);
+        }
     }
-    gpio_function_set(device->gpio, pinnum, 0);	// SPI-MOSI ALT0
 
-    // Allocate LED buffer
-    ws2811_channel_t *channel = &ws2811->channel[0];
-    channel->leds = malloc(sizeof(ws2811_led_t) * channel->count);
-    if (!channel->leds)
+    return ret;
+}
+
+/**
+ * Render the current LED arrays and start sending them, from the caller of
+ * ws2811_render() or the render thread.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, < 0 on failure.
+ */
+static ws2811_return_t render_frame(ws2811_t *ws2811)
+{
+    ws2811_return_t ret = WS2811_SUCCESS;
+
+    if (queue_mode(ws2811))
     {
-        ws2811_cleanup(ws2811);
-        return WS2811_ERROR_OUT_OF_MEMORY;
+        return queue_frame_wait(ws2811);
     }
-    memset(channel->leds, 0, sizeof(ws2811_led_t) * channel->count);
-    if (!channel->strip_type)
+
+    if (ws2811->device->stream_words)
     {
-      channel->strip_type=WS2811_STRIP_RGB;
+        if ((ret = ws2811_wait(ws2811)) != WS2811_SUCCESS)
+        {
+            return ret;
+        }
+
+        render_pace(ws2811);
+
+        return stream_render(ws2811);
     }
 
-    // Set default uncorrected gamma table
-    if (!channel->gamma)
+    // Encoded while the previous frame may still be going out
+    frame_prepare(ws2811);
+
+    // Wait for any previous DMA operation to complete.
+    if ((ret = ws2811_wait(ws2811)) != WS2811_SUCCESS)
     {
-      channel->gamma = malloc(sizeof(uint8_t) * 256);
-      int x;
-      for(x = 0; x < 256; x++){
-        channel->gamma[x] = x;
-      }
+        return ret;
     }
 
-    channel->wshift = (channel->strip_type >> 24) & 0xff;
-    channel->rshift = (channel->strip_type >> 16) & 0xff;
-    channel->gshift = (channel->strip_type >> 8)  & 0xff;
-    channel->bshift = (channel->strip_type >> 0)  & 0xff;
+    render_pace(ws2811);
 
-    // Allocate SPI transmit buffer (same size as PCM)
-    device->pxl_raw = malloc(PCM_BYTE_COUNT(device->max_count, ws2811->freq));
-    if (device->pxl_raw == NULL)
+    return frame_commit(ws2811);
+}
+
+/**
+ * Render the DMA buffer from the user supplied LED arrays and start the DMA
+ * controller.  This will update all LEDs on both PWM channels.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+ws2811_return_t  ws2811_render(ws2811_t *ws2811)
+{
+    if (ws2811->device->render_running)
     {
-        ws2811_cleanup(ws2811);
-        return WS2811_ERROR_OUT_OF_MEMORY;
+        return WS2811_ERROR_NOT_SUPPORTED;
     }
-    pcm_raw_init(ws2811);
 
-    return WS2811_SUCCESS;
+    return render_frame(ws2811);
 }
 
-static ws2811_return_t spi_transfer(ws2811_t *ws2811)
+/**
+ * Render the LED arrays and start sending them without blocking.  If the
+ * previous frame is still being sent or latched nothing is rendered and
+ * WS2811_ERROR_BUSY is returned; poll ws2811_get_fd() to know when to retry.
+ * In SPI mode the transfer itself is still synchronous.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, WS2811_ERROR_BUSY if not ready, < 0 on failure.
+ */
+ws2811_return_t ws2811_render_async(ws2811_t *ws2811)
 {
-    int ret;
-    struct spi_ioc_transfer tr;
+    ws2811_device_t *device = ws2811->device;
 
-    memset(&tr, 0, sizeof(struct spi_ioc_transfer));
-    tr.tx_buf = (unsigned long)ws2811->device->pxl_raw;
-    tr.rx_buf = 0;
-    tr.len = PCM_BYTE_COUNT(ws2811->device->max_count, ws2811->freq);
+    if (queue_mode(ws2811))
+    {
+        return ws2811_queue_frame(ws2811);
+    }
 
-    ret = ioctl(ws2811->device->spi_fd, SPI_IOC_MESSAGE(1), &tr);
-    if (ret < 1)
+    if (device->stream_words || device->render_running)
     {
-        fprintf(stderr, "Can't send spi message");
-        return WS2811_ERROR_SPI_TRANSFER;
+        return WS2811_ERROR_NOT_SUPPORTED;
     }
 
-    return WS2811_SUCCESS;
-}
+    if ((device->driver_mode != SPI) && dma_error(device))
+    {
+        fprintf(stderr, "DMA Error: %08x\n", dma_debug(device));
+        return WS2811_ERROR_DMA;
+    }
 
+    if (render_pending(ws2811))
+    {
+        return WS2811_ERROR_BUSY;
+    }
 
-/*
+    frame_prepare(ws2811);
+
+    return frame_commit(ws2811);
+}
+
+/**
+ * Encode the LED arrays into the idle frame buffer without sending it, so
+ * ws2811_commit() can later start it at a chosen moment.  Returns as soon as
+ * the frame is encoded, even while the previous one is still being sent.
+ * Preparing again before committing replaces the prepared frame.
  *
- * Application API Functions
+ * @param    ws2811  ws2811 instance pointer.
  *
+ * @returns  0 on success, WS2811_ERROR_NOT_SUPPORTED with queueing, streaming or the render thread.
  */
+ws2811_return_t ws2811_prepare(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    ws2811_return_t ret;
+
+    if (queue_mode(ws2811) || device->stream_words || device->render_running)
+    {
+        return WS2811_ERROR_NOT_SUPPORTED;
+    }
+
+    if ((ret = frame_pair_setup(ws2811)) != WS2811_SUCCESS)
+    {
+        return ret;
+    }
+
+    frame_prepare(ws2811);
 
+    return WS2811_SUCCESS;
+}
 
 /**
- * Allocate and initialize memory, buffers, pages, PWM, DMA, and GPIO.
+ * Start sending the frame from ws2811_prepare().  Only waits if the previous
+ * frame is still being sent or latched, otherwise this just starts the DMA.
  *
  * @param    ws2811  ws2811 instance pointer.
  *
- * @returns  0 on success, -1 otherwise.
+ * @returns  0 on success, WS2811_ERROR_NOT_PREPARED if no frame is prepared, < 0 on failure.
  */
-ws2811_return_t ws2811_init(ws2811_t *ws2811)
+ws2811_return_t ws2811_commit(ws2811_t *ws2811)
 {
-    ws2811_device_t *device;
-    const rpi_hw_t *rpi_hw;
-    int chan;
+    ws2811_device_t *device = ws2811->device;
+    ws2811_return_t ret;
 
-    ws2811->rpi_hw = rpi_hw_detect();
-    if (!ws2811->rpi_hw)
+    if (!device->frame_prepared)
     {
-        return WS2811_ERROR_HW_NOT_SUPPORTED;
+        return WS2811_ERROR_NOT_PREPARED;
     }
-    rpi_hw = ws2811->rpi_hw;
 
-    ws2811->device = malloc(sizeof(*ws2811->device));
-    if (!ws2811->device)
+    if ((ret = ws2811_wait(ws2811)) != WS2811_SUCCESS)
     {
-        return WS2811_ERROR_OUT_OF_MEMORY;
+        return ret;
+    }
+
+    render_pace(ws2811);
+
+    return frame_commit(ws2811);
+}
+
+/**
+ * Render a frame and start sending it at an absolute CLOCK_MONOTONIC time,
+ * for presenting frames in step with other boards or an audio clock.  The
+ * frame is encoded right away, then the previous frame is allowed to finish
+ * and latch before sleeping until the deadline.  When the deadline has
+ * already passed the frame is started at once, start_ns shows how late.
+ *
+ * @param    ws2811    ws2811 instance pointer.
+ * @param    when_ns   CLOCK_MONOTONIC time in nanoseconds to start the frame at.
+ * @param    start_ns  Set to the CLOCK_MONOTONIC time the frame was started at, may be NULL.
+ *
+ * @returns  0 on success, WS2811_ERROR_NOT_SUPPORTED with queueing, streaming or the render thread.
+ */
+ws2811_return_t ws2811_render_at(ws2811_t *ws2811, uint64_t when_ns, uint64_t *start_ns)
+{
+    ws2811_device_t *device = ws2811->device;
+    struct timespec wakeup;
+    ws2811_return_t ret;
+
+    if (queue_mode(ws2811) || device->stream_words || device->render_running)
+    {
+        return WS2811_ERROR_NOT_SUPPORTED;
     }
-    memset(ws2811->device, 0, sizeof(*ws2811->device));
-    device = ws2811->device;
 
-    if (check_hwver_and_gpionum(ws2811) < 0)
+    if ((ret = frame_pair_setup(ws2811)) != WS2811_SUCCESS)
     {
-        return WS2811_ERROR_ILLEGAL_GPIO;
+        return ret;
     }
 
-    device->max_count = max_channel_led_count(ws2811);
+    frame_prepare(ws2811);
 
-    if (device->driver_mode == SPI) {
-        return spi_init(ws2811);
+    if ((ret = ws2811_wait(ws2811)) != WS2811_SUCCESS)
+    {
+        return ret;
     }
 
-    // Determine how much physical memory we need for DMA
-    switch (device->driver_mode) {
-    case PWM:
-        device->mbox.size = PWM_BYTE_COUNT(device->max_count, ws2811->freq) +
-                            sizeof(dma_cb_t);
-        break;
+    render_pace(ws2811);
 
-    case PCM:
-        device->mbox.size = PCM_BYTE_COUNT(device->max_count, ws2811->freq) +
-                            sizeof(dma_cb_t);
-        break;
-    }
-    // Round up to page size multiple
-    device->mbox.size = (device->mbox.size + (PAGE_SIZE - 1)) & ~(PAGE_SIZE - 1);
+    wakeup.tv_sec = when_ns / 1000000000;
+    wakeup.tv_nsec = when_ns % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup, NULL) == EINTR)
+        ;
 
-    device->mbox.handle = mbox_open();
-    if (device->mbox.handle == -1)
-    {
-        return WS2811_ERROR_MAILBOX_DEVICE;
-    }
+    ret = frame_commit(ws2811);
 
-    device->mbox.mem_ref = mem_alloc(device->mbox.handle, device->mbox.size, PAGE_SIZE,
-                                     rpi_hw->videocore_base == 0x40000000 ? 0xC : 0x4);
-    if (device->mbox.mem_ref == 0)
+    if (start_ns)
     {
-        return WS2811_ERROR_OUT_OF_MEMORY;
+        *start_ns = device->start_ns;
     }
 
-    device->mbox.bus_addr = mem_lock(device->mbox.handle, device->mbox.mem_ref);
-    if (device->mbox.bus_addr == (uint32_t) ~0UL)
+    return ret;
+}
+
+/**
+ * Render a frame on several instances at once.  All frames are encoded first,
+ * then every previous frame is waited for, so the frame time is that of the
+ * slowest output rather than the sum of all of them.  The DMA engines are
+ * then started back to back so the strings update almost simultaneously,
+ * followed by the SPI transfers.  Each instance encodes with its own
+ * encode_threads.
+ *
+ * @param    list  Array of ws2811 instance pointers.
+ * @param    n     Number of instances in list.
+ *
+ * @returns  0 on success, WS2811_ERROR_OUT_OF_RANGE for an empty list,
+ *           WS2811_ERROR_NOT_SUPPORTED if an instance queues, streams or runs the render
+ *           thread, otherwise the first error of an instance.
+ */
+ws2811_return_t ws2811_render_many(ws2811_t **list, int n)
+{
+    ws2811_return_t ret = WS2811_SUCCESS;
+    int i, spi;
+
+    if (!list || (n <= 0))
     {
-       mem_free(device->mbox.handle, device->mbox.size);
-       return WS2811_ERROR_MEM_LOCK;
+        return WS2811_ERROR_OUT_OF_RANGE;
     }
 
-    device->mbox.virt_addr = mapmem(BUS_TO_PHYS(device->mbox.bus_addr), device->mbox.size, DEV_MEM);
-    if (!device->mbox.virt_addr)
+    for (i = 0; i < n; i++)
     {
-        mem_unlock(device->mbox.handle, device->mbox.mem_ref);
-        mem_free(device->mbox.handle, device->mbox.size);
+        ws2811_device_t *device = list[i]->device;
 
-        ws2811_cleanup(ws2811);
-        return WS2811_ERROR_MMAP;
+        if (queue_mode(list[i]) || device->stream_words || device->render_running)
+        {
+            return WS2811_ERROR_NOT_SUPPORTED;
+        }
     }
 
-    // Initialize all pointers to NULL.  Any non-NULL pointers will be freed on cleanup.
-    device->pxl_raw = NULL;
-    device->dma_cb = NULL;
-    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    for (i = 0; i < n; i++)
     {
-        ws2811->channel[chan].leds = NULL;
+        frame_prepare(list[i]);
     }
 
-    // Allocate the LED buffers
-    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    for (i = 0; i < n; i++)
     {
-        ws2811_channel_t *channel = &ws2811->channel[chan];
-
-        channel->leds = malloc(sizeof(ws2811_led_t) * channel->count);
-        if (!channel->leds)
+        if ((ret = ws2811_wait(list[i])) != WS2811_SUCCESS)
         {
-            ws2811_cleanup(ws2811);
-            return WS2811_ERROR_OUT_OF_MEMORY;
+            return ret;
         }
+    }
 
-        memset(channel->leds, 0, sizeof(ws2811_led_t) * channel->count);
+    for (i = 0; i < n; i++)
+    {
+        render_pace(list[i]);
+    }
 
-        if (!channel->strip_type)
+    // SPI transfers are synchronous, so start every DMA engine before any of them
+    for (spi = 0; spi <= 1; spi++)
+    {
+        for (i = 0; i < n; i++)
         {
-          channel->strip_type=WS2811_STRIP_RGB;
+            ws2811_return_t err;
+
+            if ((list[i]->device->driver_mode == SPI) != spi)
+            {
+                continue;
+            }
+
+            err = frame_commit(list[i]);
+            if ((err != WS2811_SUCCESS) && (ret == WS2811_SUCCESS))
+            {
+                ret = err;
+            }
         }
+    }
 
-        // Set default uncorrected gamma table
-        if (!channel->gamma)
+    return ret;
+}
+
+/**
+ * Get a descriptor that becomes readable when the last frame has been sent
+ * and latched, and a new frame may be rendered.  It is suitable for use with
+ * poll(), select() or epoll and stays readable until the next frame is
+ * started, so reading from it is optional.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  File descriptor owned by the library, closed by ws2811_fini().
+ */
+int ws2811_get_fd(ws2811_t *ws2811)
+{
+    return ws2811->device->timer_fd;
+}
+
+/**
+ * Attach a caller supplied LED array to a channel in place of channel->leds,
+ * for example a shared memory mapping another process writes into.  It must
+ * hold the channel's count LEDs.  The swap takes effect for the next frame
+ * encoded and never in the middle of one, so it may be done from another
+ * thread while rendering.  The previous array must then stay valid until the
+ * frame being rendered is done, and a library allocated one is only freed
+ * here, so replace that one between renders.
+ *
+ * @param    ws2811   ws2811 instance pointer.
+ * @param    channum  Channel index.
+ * @param    leds     LED array, NULL to go back to one allocated by the library.
+ * @param    flags    WS2811_LEDS_xxx ownership flags.
+ *
+ * @returns  0 on success, WS2811_ERROR_OUT_OF_RANGE for an invalid channum, < 0 on failure.
+ */
+ws2811_return_t ws2811_attach_leds(ws2811_t *ws2811, int channum, ws2811_led_t *leds, uint32_t flags)
+{
+    ws2811_device_t *device = ws2811->device;
+    ws2811_channel_t *channel;
+    ws2811_led_t *old;
+    int old_owned;
+
+    if ((channum < 0) || (channum >= RPI_PWM_CHANNELS))
+    {
+        return WS2811_ERROR_OUT_OF_RANGE;
+    }
+    channel = &ws2811->channel[channum];
+    old = channel->leds;
+    old_owned = device->leds_owned[channum];
+
+    if (!leds)
+    {
+        leds = calloc(channel->count + 1, sizeof(ws2811_led_t));
+        if (!leds)
         {
-          channel->gamma = malloc(sizeof(uint8_t) * 256);
-          int x;
-          for(x = 0; x < 256; x++){
-            channel->gamma[x] = x;
-          }
+            return WS2811_ERROR_OUT_OF_MEMORY;
         }
+        flags |= WS2811_LEDS_OWNED;
+    }
 
-        channel->wshift = (channel->strip_type >> 24) & 0xff;
-        channel->rshift = (channel->strip_type >> 16) & 0xff;
-        channel->gshift = (channel->strip_type >> 8)  & 0xff;
-        channel->bshift = (channel->strip_type >> 0)  & 0xff;
+    // Publish the array only once the caller's writes to it are visible.  The
+    // field stays a plain pointer in the public struct, so the GCC builtins
+    // stand in for an _Atomic qualifier.
+    __atomic_store_n(&channel->leds, leds, __ATOMIC_RELEASE);
+    device->leds_owned[channum] = !!(flags & WS2811_LEDS_OWNED);
+    device->leds_count[channum] = channel->count;
 
+    if (old && old_owned && (old != leds))
+    {
+        free(old);
     }
 
-    device->dma_cb = (dma_cb_t *)device->mbox.virt_addr;
-    device->pxl_raw = (uint8_t *)device->mbox.virt_addr + sizeof(dma_cb_t);
+    return WS2811_SUCCESS;
+}
 
-    switch (device->driver_mode) {
-    case PWM:
-       pwm_raw_init(ws2811);
-       break;
+/**
+ * Copy pixels from a caller's buffer into a channel's LED array, converting
+ * them to 0xWWRRGGBB.  Meant for bindings, so a whole frame needs one call
+ * instead of one per LED.  With render_rate set the pixels go to the array
+ * from ws2811_frame_leds().  Packed sources are converted 16 pixels at a
+ * time with NEON when available.
+ *
+ * @param    ws2811   ws2811 instance pointer.
+ * @param    channum  Channel index.
+ * @param    offset   First LED to write.
+ * @param    src      First source pixel.
+ * @param    count    Number of pixels.
+ * @param    format   WS2811_FORMAT_xxx layout of each source pixel.
+ * @param    stride   Bytes from one source pixel to the next, 0 if packed.
+ *
+ * @returns  0 on success, WS2811_ERROR_OUT_OF_RANGE for an invalid channum or LED range, < 0 on failure.
+ */
+ws2811_return_t ws2811_set_pixels(ws2811_t *ws2811, int channum, int offset, const void *src,
+                                  int count, int format, int stride)
+{
+    static const int format_bytes[] = { 3, 3, 4, 4, 4 };
+    ws2811_channel_t *channel;
+    ws2811_led_t *leds;
+    const uint8_t *pixel = src;
+    int i = 0;
 
-    case PCM:
-       pcm_raw_init(ws2811);
-       break;
+    if ((channum < 0) || (channum >= RPI_PWM_CHANNELS))
+    {
+        return WS2811_ERROR_OUT_OF_RANGE;
     }
+    channel = &ws2811->channel[channum];
+    leds = ws2811->render_rate ? ws2811_frame_leds(ws2811, channum) : channel->leds;
 
-    memset((dma_cb_t *)device->dma_cb, 0, sizeof(dma_cb_t));
-
-    // Cache the DMA control block bus address
-    device->dma_cb_addr = addr_to_bus(device, device->dma_cb);
+    if ((format < 0) || (format > WS2811_FORMAT_WRGB32) || !leds || !src)
+    {
+        return WS2811_ERROR_NOT_SUPPORTED;
+    }
 
-    // Map the physical registers into userspace
-    if (map_registers(ws2811))
+    if ((offset < 0) || (count < 0) || (offset + count > channel->count))
     {
-        ws2811_cleanup(ws2811);
-        return WS2811_ERROR_MAP_REGISTERS;
+        return WS2811_ERROR_OUT_OF_RANGE;
     }
 
-    // Initialize the GPIO pins
-    if (gpio_init(ws2811))
+    if (!stride)
     {
-        unmap_registers(ws2811);
-        ws2811_cleanup(ws2811);
-        return WS2811_ERROR_GPIO_INIT;
+        stride = format_bytes[format];
     }
+    leds += offset;
 
-    switch (device->driver_mode) {
-    case PWM:
-        // Setup the PWM, clocks, and DMA
-        if (setup_pwm(ws2811))
+#ifdef __ARM_NEON
+    if (stride == format_bytes[format])
+    {
+        // Stored as 0xWWRRGGBB, so B, G, R, W in memory
+        for (; i + 16 <= count; i += 16, pixel += 16 * stride)
         {
-            unmap_registers(ws2811);
-            ws2811_cleanup(ws2811);
-            return WS2811_ERROR_PWM_SETUP;
+            uint8x16x4_t out;
+
+            if (stride == 3)
+            {
+                uint8x16x3_t in = vld3q_u8(pixel);
+                int red = (format == WS2811_FORMAT_BGR) ? 2 : 0;
+
+                out.val[0] = in.val[2 - red];
+                out.val[1] = in.val[1];
+                out.val[2] = in.val[red];
+                out.val[3] = vdupq_n_u8(0);
+            }
+            else if (format == WS2811_FORMAT_WRGB32)
+            {
+                out = vld4q_u8(pixel);
+            }
+            else
+            {
+                uint8x16x4_t in = vld4q_u8(pixel);
+
+                out.val[0] = in.val[2];
+                out.val[1] = in.val[1];
+                out.val[2] = in.val[0];
+                out.val[3] = (format == WS2811_FORMAT_RGBW) ? in.val[3] : vdupq_n_u8(0);
+            }
+
+            vst4q_u8((uint8_t *)&leds[i], out);
         }
-        break;
-    case PCM:
-    // Setup the PCM, clock, and DMA
-        if (setup_pcm(ws2811))
+    }
+#endif
+
+    for (; i < count; i++, pixel += stride)
+    {
+        switch (format)
         {
-            unmap_registers(ws2811);
-            ws2811_cleanup(ws2811);
-            return WS2811_ERROR_PCM_SETUP;
+        case WS2811_FORMAT_RGB888:
+        case WS2811_FORMAT_RGBA:
+            leds[i] = (pixel[0] << 16) | (pixel[1] << 8) | pixel[2];
+            break;
+        case WS2811_FORMAT_BGR:
+            leds[i] = (pixel[2] << 16) | (pixel[1] << 8) | pixel[0];
+            break;
+        case WS2811_FORMAT_RGBW:
+            leds[i] = ((uint32_t)pixel[3] << 24) | (pixel[0] << 16) | (pixel[1] << 8) | pixel[2];
+            break;
+        case WS2811_FORMAT_WRGB32:
+            memcpy(&leds[i], pixel, sizeof(leds[i]));
+            break;
         }
-        break;
     }
 
     return WS2811_SUCCESS;
 }
 
 /**
- * Shut down DMA, PWM, and cleanup memory.
+ * Encode one channel into the exact buffer a driver mode sends, without any
+ * hardware or ws2811_init().  The result is a frame including the reset time,
+ * in memory order for PCM and SPI and as the words the PWM FIFO takes for a
+ * single PWM channel.  Uses the same encoder as ws2811_render().  gamma may be
+ * NULL for none, and the shifts are taken from strip_type.
  *
- * @param    ws2811  ws2811 instance pointer.
+ * @param    channel  Channel to encode, only leds, count, strip_type, invert, brightness and gamma are used.
+ * @param    mode     WS2811_MODE_xxx driver mode.
+ * @param    timing   WS2811_TIMING_xxx chip timing profile.
+ * @param    freq     Bit rate, 0 for the timing profile's.
+ * @param    dst      Word aligned buffer to encode into, may be NULL to only get the length.
+ * @param    cap      Size of dst in bytes.
+ * @param    len      Returns the number of bytes the frame takes.
  *
- * @returns  None
+ * @returns  0 on success, WS2811_ERROR_OUT_OF_MEMORY if cap is too small, < 0 on failure.
  */
-void ws2811_fini(ws2811_t *ws2811)
+ws2811_return_t ws2811_encode(const ws2811_channel_t *channel, int mode, int timing, uint32_t freq,
+                              void *dst, size_t cap, size_t *len)
 {
-    volatile pcm_t *pcm = ws2811->device->pcm;
-
-    ws2811_wait(ws2811);
-    switch (ws2811->device->driver_mode) {
-    case PWM:
-        stop_pwm(ws2811);
-        break;
-    case PCM:
-        while (!(pcm->cs & RPI_PCM_CS_TXE)) ;    // Wait till TX FIFO is empty
-        stop_pcm(ws2811);
-        break;
+    uint8_t gamma_none[256];
+    ws2811_device_t device;
+    ws2811_channel_t *chan;
+    ws2811_t ws2811;
+    size_t bytes;
+    int x;
+
+    if ((mode != WS2811_MODE_PWM) && (mode != WS2811_MODE_PCM) && (mode != WS2811_MODE_SPI))
+    {
+        return WS2811_ERROR_NOT_SUPPORTED;
     }
 
-    unmap_registers(ws2811);
-
-    ws2811_cleanup(ws2811);
-}
+    memset(&ws2811, 0, sizeof(ws2811));
+    memset(&device, 0, sizeof(device));
+    ws2811.device = &device;
+    ws2811.freq = freq;
+    ws2811.timing = timing;
+    device.driver_mode = mode;
+    device.fifo_chans = 1;
+    device.max_count = channel->count;
 
-/**
- * Wait for any executing DMA operation to complete before returning.
- *
- * @param    ws2811  ws2811 instance pointer.
- *
- * @returns  0 on success, -1 on DMA competion error
- */
-ws2811_return_t ws2811_wait(ws2811_t *ws2811)
-{
-    volatile dma_t *dma = ws2811->device->dma;
+    if (timing_setup(&ws2811))
+    {
+        return WS2811_ERROR_NOT_SUPPORTED;
+    }
 
-    if (ws2811->device->driver_mode == SPI)  // Nothing to do for SPI
+    bytes = frame_bytes(&ws2811);
+    if (len)
+    {
+        *len = bytes;
+    }
+    if (!dst)
     {
         return WS2811_SUCCESS;
     }
-
-    while ((dma->cs & RPI_DMA_CS_ACTIVE) &&
-           !(dma->cs & RPI_DMA_CS_ERROR))
+    if (cap < bytes)
     {
-        usleep(10);
+        return WS2811_ERROR_OUT_OF_MEMORY;
     }
 
-    if (dma->cs & RPI_DMA_CS_ERROR)
+    // Fill in what ws2811_init() would have
+    chan = &ws2811.channel[0];
+    *chan = *channel;
+    if (!chan->strip_type)
     {
-        fprintf(stderr, "DMA Error: %08x\n", dma->debug);
-        return WS2811_ERROR_DMA;
+        chan->strip_type = WS2811_STRIP_RGB;
     }
+    if (!chan->gamma)
+    {
+        for (x = 0; x < 256; x++)
+        {
+            gamma_none[x] = x;
+        }
+        chan->gamma = gamma_none;
+    }
+    chan->wshift = (chan->strip_type >> 24) & 0xff;
+    chan->rshift = (chan->strip_type >> 16) & 0xff;
+    chan->gshift = (chan->strip_type >> 8)  & 0xff;
+    chan->bshift = (chan->strip_type >> 0)  & 0xff;
+
+    render_encode(&ws2811, dst);
 
     return WS2811_SUCCESS;
 }
 
 /**
- * Render the DMA buffer from the user supplied LED arrays and start the DMA
- * controller.  This will update all LEDs on both PWM channels.
+ * Render thread, sends the newest published frame render_rate times a second.
  *
- * @param    ws2811  ws2811 instance pointer.
+ * @param    arg  ws2811 instance pointer.
  *
- * @returns  None
+ * @returns  NULL
  */
-ws2811_return_t  ws2811_render(ws2811_t *ws2811)
+static void *render_thread(void *arg)
 {
-	static uint8_t convert_table[3][256] =
-	{ 
-		{
-			0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92,  
-			0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 
-			0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x93, 0x93, 0x93, 
-			0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 
-			0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 0x93, 
-			0x93, 0x93, 0x93, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 
-			0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 
-			0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9A, 0x9B, 0x9B, 0x9B, 0x9B, 
-			0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 
-			0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 0x9B, 
-			0x9B, 0x9B, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 
-			0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 
-			0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD2, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 
-			0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 
-			0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 0xD3, 
-			0xD3, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 
-			0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 
-			0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDA, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 
-			0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 
-			0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB, 0xDB 
-		},
-		{		 
-			0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x4D, 
-			0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 
-			0x69, 0x69, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x49, 0x49, 0x49, 
-			0x49, 0x49, 0x49, 0x49, 0x49, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 
-			0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 
-			0x6D, 0x6D, 0x6D, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x4D, 0x4D, 
-			0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 
-			0x69, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x49, 0x49, 0x49, 0x49, 
-			0x49, 0x49, 0x49, 0x49, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x69, 
-			0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 
-			0x6D, 0x6D, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x4D, 0x4D, 0x4D, 
-			0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 
-			0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x49, 0x49, 0x49, 0x49, 0x49, 
-			0x49, 0x49, 0x49, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x69, 0x69, 
-			0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 
-			0x6D, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x4D, 0x4D, 0x4D, 0x4D, 
-			0x4D, 0x4D, 0x4D, 0x4D, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x69, 0x6D, 
-			0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 
-			0x49, 0x49, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x4D, 0x69, 0x69, 0x69, 
-			0x69, 0x69, 0x69, 0x69, 0x69, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D, 0x6D 		
-		},		
-		{
-			0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 
-			0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 
-			0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 
-			0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 
-			0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 
-			0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 
-			0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 
-			0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 
-			0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 
-			0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 
-			0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 
-			0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 
-			0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 
-			0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 
-			0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 
-			0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 
-			0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 
-			0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 
-			0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 
-			0x36, 0xA4, 0xA6, 0xB4, 0xB6, 0x24, 0x26, 0x34, 0x36, 0xA4, 0xA6, 0xB4, 0xB6 
-		}
-	};
-
-    volatile uint8_t *pxl_raw = ws2811->device->pxl_raw;
-    int driver_mode = ws2811->device->driver_mode;
-    int i, l, chan;
-    unsigned j;
-    ws2811_return_t ret = WS2811_SUCCESS;
-    uint32_t protocol_time = 0;
-    static uint64_t previous_timestamp = 0;
+    ws2811_t *ws2811 = arg;
+    ws2811_device_t *device = ws2811->device;
+    uint64_t period = 1000000 / ws2811->render_rate;
+    struct timespec next, now;
+    int chan;
 
-    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)         // Channel
-    {
-        ws2811_channel_t *channel = &ws2811->channel[chan];
+    clock_gettime(CLOCK_MONOTONIC, &next);
 
-        int wordpos = chan; // PWM & PCM
-        int bytepos = 0;    // SPI
-        const int scale = (channel->brightness & 0xff) + 1;
-        uint8_t array_size = 3; // Assume 3 color LEDs, RGB
+    while (!atomic_load(&device->render_stop))
+    {
+        ws2811_return_t ret;
 
-        // If our shift mask includes the highest nibble, then we have 4 LEDs, RBGW.
-        if (channel->strip_type & SK6812_SHIFT_WMASK)
+        // Swap in the newest frame, otherwise resend the current one
+        if (atomic_load(&device->frame_state) & FRAME_FRESH)
         {
-            array_size = 4;
+            device->frame_front = atomic_exchange(&device->frame_state, device->frame_front) & ~FRAME_FRESH;
         }
 
-        // 1.25µs per bit
-        const uint32_t channel_protocol_time = channel->count * array_size * 8 * 1.25;
-
-        // Only using the channel which takes the longest as both run in parallel
-        if (channel_protocol_time > protocol_time)
+        for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
         {
-            protocol_time = channel_protocol_time;
+            device->render_leds[chan] = device->frame_leds[chan] +
+                                        device->frame_front * ws2811->channel[chan].count;
         }
 
-        for (i = 0; i < channel->count; i++)                // Led
+        ret = render_frame(ws2811);
+        if (ret != WS2811_SUCCESS)
         {
-            uint8_t color[] =
-            {
-                channel->gamma[(((channel->leds[i] >> channel->rshift) & 0xff) * scale) >> 8], // red
-                channel->gamma[(((channel->leds[i] >> channel->gshift) & 0xff) * scale) >> 8], // green
-                channel->gamma[(((channel->leds[i] >> channel->bshift) & 0xff) * scale) >> 8], // blue
-                channel->gamma[(((channel->leds[i] >> channel->wshift) & 0xff) * scale) >> 8], // white
-            };
+            atomic_store(&device->render_ret, ret);
+        }
 
-            for (j = 0; j < array_size; j++)               // Color
-            {
-				for(l = 0; l < 3; ++l)
-				{
-					uint8_t pos = driver_mode == SPI ? bytepos : 3 - bytepos;
-					uint8_t val = convert_table[l][color[j]];
-					if ((driver_mode != PWM) && channel->invert) val = ~val;
-					
-					pxl_raw[wordpos * 4 + pos] = val;
-					if(++bytepos == 4) 
-					{ 
-						bytepos = 0; 
-						wordpos += driver_mode == PWM ? 2 : 1; 
-					}
-				}
-            }
+        // Don't try to catch up on frames missed while running late
+        timespec_add_us(&next, period);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec > next.tv_sec) || ((now.tv_sec == next.tv_sec) && (now.tv_nsec > next.tv_nsec)))
+        {
+            next = now;
         }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
     }
 
-    // Wait for any previous DMA operation to complete.
-    if ((ret = ws2811_wait(ws2811)) != WS2811_SUCCESS)
+    ws2811_wait(ws2811);
+
+    return NULL;
+}
+
+/**
+ * Get the LED array to fill for the next published frame when render_rate is
+ * set.  It holds an older frame, so every LED has to be written.  The array
+ * changes with every ws2811_frame_publish().
+ *
+ * @param    ws2811   ws2811 instance pointer.
+ * @param    channum  Channel index.
+ *
+ * @returns  LED array of the channel's count, NULL if render_rate isn't set or channum is invalid.
+ */
+ws2811_led_t *ws2811_frame_leds(ws2811_t *ws2811, int channum)
+{
+    ws2811_device_t *device = ws2811->device;
+
+    if ((channum < 0) || (channum >= RPI_PWM_CHANNELS) || !device->frame_leds[channum])
     {
-        return ret;
+        return NULL;
     }
 
-    if (ws2811->render_wait_time != 0) {
-        const uint64_t current_timestamp = get_microsecond_timestamp();
-        uint64_t time_diff = current_timestamp - previous_timestamp;
+    return device->frame_leds[channum] + device->frame_back * ws2811->channel[channum].count;
+}
 
-        if (ws2811->render_wait_time > time_diff) {
-            usleep(ws2811->render_wait_time - time_diff);
-        }
-    }
+/**
+ * Publish the arrays from ws2811_frame_leds() as the newest frame.  Frames
+ * published faster than render_rate replace each other, the render thread
+ * always sends the newest one.  The first call starts the render thread.
+ * Never blocks on the DMA and takes no locks.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, the render thread's last error since the previous call otherwise.
+ */
+ws2811_return_t ws2811_frame_publish(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
 
-    if (driver_mode != SPI)
+    if (!device->frame_leds[0])
     {
-        dma_start(ws2811);
+        return WS2811_ERROR_NOT_SUPPORTED;
     }
-    else
+
+    device->frame_back = atomic_exchange(&device->frame_state, device->frame_back | FRAME_FRESH) & ~FRAME_FRESH;
+
+    if (!device->render_running)
     {
-        ret = spi_transfer(ws2811);
+        atomic_store(&device->render_stop, 0);
+        if (pthread_create(&device->render_tid, NULL, render_thread, ws2811))
+        {
+            return WS2811_ERROR_THREAD;
+        }
+        device->render_running = 1;
+        ws2811->rt_status |= rt_thread_setup(ws2811, device->render_tid, ws2811->rt_cpus);
     }
 
-    // LED_RESET_WAIT_TIME is added to allow enough time for the reset to occur.
-    previous_timestamp = get_microsecond_timestamp();
-    ws2811->render_wait_time = protocol_time + LED_RESET_WAIT_TIME;
-
-    return ret;
+    return atomic_exchange(&device->render_ret, WS2811_SUCCESS);
 }
 
 const char * ws2811_get_return_t_str(const ws2811_return_t state)
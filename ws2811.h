@@ -35,6 +35,7 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "rpihw.h"
@@ -65,6 +66,37 @@ extern "C" {
 #define SK6812_STRIP                             WS2811_STRIP_GRB
 #define SK6812W_STRIP                            SK6812_STRIP_GRBW
 
+// Chip timing profiles, symbols per bit, bit rate and reset time
+#define WS2811_TIMING_DEFAULT                    0        // 3 symbols per bit, 800kHz, 55µs reset
+#define WS2811_TIMING_WS2812B                    1        // 3 symbols per bit, 800kHz, 280µs reset
+#define WS2811_TIMING_WS2813                     2        // 3 symbols per bit, 800kHz, 280µs reset
+#define WS2811_TIMING_WS2815                     3        // 3 symbols per bit, 800kHz, 280µs reset
+#define WS2811_TIMING_SK6812                     4        // 4 symbols per bit, 800kHz, 80µs reset
+#define WS2811_TIMING_GS8208                     5        // 4 symbols per bit, 800kHz, 280µs reset
+#define WS2811_TIMING_WS2812B_1M                 6        // 3 symbols per bit, 1MHz, 280µs reset
+#define WS2811_TIMING_SK6812_1M2                 7        // 5 symbols per bit, 1.2MHz, 80µs reset
+
+// Ownership flags for ws2811_attach_leds()
+#define WS2811_LEDS_OWNED                        (1 << 0) // Library frees the array with free() once replaced or on cleanup
+
+// Driver modes for ws2811_encode()
+#define WS2811_MODE_PWM                          1
+#define WS2811_MODE_PCM                          2
+#define WS2811_MODE_SPI                          3
+
+// Source pixel formats for ws2811_set_pixels()
+#define WS2811_FORMAT_RGB888                     0        // 3 bytes, R G B
+#define WS2811_FORMAT_BGR                        1        // 3 bytes, B G R
+#define WS2811_FORMAT_RGBA                       2        // 4 bytes, R G B A, alpha ignored
+#define WS2811_FORMAT_RGBW                       3        // 4 bytes, R G B W
+#define WS2811_FORMAT_WRGB32                     4        // Native uint32_t 0xWWRRGGBB, same as ws2811_led_t
+
+// Real-time controls reported in rt_status
+#define WS2811_RT_LOCKED                         (1 << 0) // Library buffers locked in RAM
+#define WS2811_RT_PREFAULTED                     (1 << 1) // Library buffers faulted in
+#define WS2811_RT_FIFO                           (1 << 2) // Rendering thread runs SCHED_FIFO at rt_priority
+#define WS2811_RT_AFFINITY                       (1 << 3) // Rendering thread pinned to rt_cpus
+
 struct ws2811_device;
 
 typedef uint32_t ws2811_led_t;                   //< 0xWWRRGGBB
@@ -88,9 +120,24 @@ typedef struct ws2811_t
     uint64_t render_wait_time;                   //< time in µs before the next render can run
     struct ws2811_device *device;                //< Private data for driver use
     const rpi_hw_t *rpi_hw;                      //< RPI Hardware Information
-    uint32_t freq;                               //< Required output frequency
-    int dmanum;                                  //< DMA number _not_ already in use
+    uint32_t freq;                               //< Required output frequency, 0 for the timing profile's
+    int dmanum;                                  //< DMA number _not_ already in use, -1 to pick one
     ws2811_channel_t channel[RPI_PWM_CHANNELS];
+    int poll_wait;                               //< Poll for DMA completion instead of sleeping until it is due
+    int queue_frames;                            //< Frames ws2811_queue_frame() can hold, 0 to disable queueing
+    uint32_t frame_interval;                     //< Time in µs from the start of one queued frame to the next
+    uint32_t refresh_rate;                       //< Resend the last frame this many times a second, 0 to disable
+    int stream_leds;                             //< Stream the frame in segments of this many LEDs, 0 to disable
+    uint32_t freq_actual;                        //< Output frequency achieved by the clock, set by ws2811_init()
+    int timing;                                  //< Chip timing profile -- one of WS2811_TIMING_xxx constants
+    int encode_threads;                          //< Threads encoding each frame, including the caller, 0 or 1 for none
+    uint32_t encode_cpus;                        //< CPU mask the encoder threads are pinned to, 0 for any
+    uint32_t render_rate;                        //< Frames a second sent by the library render thread, 0 to disable
+    int rt_priority;                             //< SCHED_FIFO priority for the rendering thread, 0 to leave it
+    uint32_t rt_cpus;                            //< CPU mask for the rendering thread, 0 to leave it
+    int rt_lock;                                 //< Lock and prefault the library's buffers in RAM
+    uint32_t rt_status;                          //< WS2811_RT_xxx controls that took effect, set by ws2811_init()
+    int pwm_tail;                                //< Unequal PWM counts: saves memory only, not bus time, see README
 } ws2811_t;
 
 #define WS2811_RETURN_STATES(X)                                                             \
@@ -108,7 +155,15 @@ typedef struct ws2811_t
             X(-11, WS2811_ERROR_ILLEGAL_GPIO, "Selected GPIO not possible"),                \
             X(-12, WS2811_ERROR_PCM_SETUP, "Unable to initialize PCM"),                     \
             X(-13, WS2811_ERROR_SPI_SETUP, "Unable to initialize SPI"),                     \
-            X(-14, WS2811_ERROR_SPI_TRANSFER, "SPI transfer error")                         \
+            X(-14, WS2811_ERROR_SPI_TRANSFER, "SPI transfer error"),                        \
+            X(-15, WS2811_ERROR_BUSY, "Previous frame still in progress"),                  \
+            X(-16, WS2811_ERROR_NOT_SUPPORTED, "Not supported in this driver mode"),        \
+            X(-17, WS2811_ERROR_UNDERRUN, "DMA ran out of streamed data"),                  \
+            X(-18, WS2811_ERROR_DMA_IN_USE, "DMA channel in use by another process"),       \
+            X(-19, WS2811_ERROR_ILLEGAL_FREQ, "Requested frequency can't be generated"),    \
+            X(-20, WS2811_ERROR_THREAD, "Unable to start encoder threads"),                 \
+            X(-21, WS2811_ERROR_OUT_OF_RANGE, "LED range beyond the channel's count"),      \
+            X(-22, WS2811_ERROR_NOT_PREPARED, "No frame prepared to commit")                \
 
 #define WS2811_RETURN_STATES_ENUM(state, name, str) name = state
 #define WS2811_RETURN_STATES_STRING(state, name, str) str
@@ -123,6 +178,24 @@ ws2811_return_t ws2811_init(ws2811_t *ws2811);
 void ws2811_fini(ws2811_t *ws2811);                                             //< Tear it all down
 ws2811_return_t ws2811_render(ws2811_t *ws2811);                                //< Send LEDs off to hardware
 ws2811_return_t ws2811_wait(ws2811_t *ws2811);                                  //< Wait for DMA completion
+ws2811_return_t ws2811_render_async(ws2811_t *ws2811);                          //< Send LEDs without blocking, WS2811_ERROR_BUSY if not ready
+int ws2811_get_fd(ws2811_t *ws2811);                                            //< Descriptor readable when a new frame can be rendered
+ws2811_return_t ws2811_queue_frame(ws2811_t *ws2811);                           //< Append LEDs to the DMA frame queue, WS2811_ERROR_BUSY if full
+ws2811_led_t *ws2811_frame_leds(ws2811_t *ws2811, int channum);                 //< LED array to fill for the next published frame
+ws2811_return_t ws2811_frame_publish(ws2811_t *ws2811);                          //< Hand the filled arrays to the render thread
+ws2811_return_t ws2811_attach_leds(ws2811_t *ws2811, int channum,
+                                   ws2811_led_t *leds, uint32_t flags);          //< Use a caller supplied LED array for a channel
+ws2811_return_t ws2811_set_pixels(ws2811_t *ws2811, int channum, int offset,
+                                  const void *src, int count, int format,
+                                  int stride);                                   //< Convert and copy pixels into a channel
+ws2811_return_t ws2811_encode(const ws2811_channel_t *channel, int mode, int timing,
+                              uint32_t freq, void *dst, size_t cap, size_t *len); //< Encode a channel without hardware
+ws2811_return_t ws2811_reconfigure(ws2811_t *ws2811);                           //< Apply changed counts, strip types or timing in place
+ws2811_return_t ws2811_prepare(ws2811_t *ws2811);                               //< Encode the next frame without sending it
+ws2811_return_t ws2811_commit(ws2811_t *ws2811);                                //< Start sending the prepared frame
+ws2811_return_t ws2811_render_at(ws2811_t *ws2811, uint64_t when_ns,
+                                 uint64_t *start_ns);                            //< Render and start at a CLOCK_MONOTONIC time
+ws2811_return_t ws2811_render_many(ws2811_t **list, int n);                     //< Render on several instances with a single wait
 const char * ws2811_get_return_t_str(const ws2811_return_t state);              //< Get string representation of the given return state
 void ws2811_set_custom_gamma_factor(ws2811_t *ws2811, double gamma_factor);     //< Set a custom Gamma correction array based on a gamma correction factor
 